@@ -0,0 +1,83 @@
+-- compares ogg_sync_pageout with and without CRC verification
+--
+-- usage: LUA_CPATH="./csrc/?.so;;" lua bench/sync_trusted.lua [megabytes] [rounds]
+
+local ogg = require'luaogg'
+
+local megabytes = tonumber(arg[1]) or 64
+local rounds = tonumber(arg[2]) or 5
+
+-- build an in-memory stream of ~4k pages filled with pseudo-random data
+local function make_stream(size)
+  local stream = ogg.ogg_stream_state()
+  local pages = {}
+  local total = 0
+  local seed = 1
+  local granulepos = ogg.ogg_int64_t(0)
+
+  local chunk = {}
+  for i=1,1024 do
+    seed = (seed * 1103515245 + 12345) % 2147483648
+    chunk[i] = string.char(seed % 256)
+  end
+  chunk = table.concat(chunk)
+
+  stream:init(1234)
+  local packetno = 0
+  while total < size do
+    granulepos = granulepos + 960
+    stream:packetin({
+      packet = chunk,
+      b_o_s = packetno == 0,
+      e_o_s = false,
+      granulepos = granulepos,
+      packetno = packetno,
+    })
+    packetno = packetno + 1
+    local page = stream:pageout()
+    while page do
+      pages[#pages + 1] = page.header
+      pages[#pages + 1] = page.body
+      total = total + page.header_len + page.body_len
+      page = stream:pageout()
+    end
+  end
+  return table.concat(pages)
+end
+
+local function run(data, trusted, sample)
+  local sync = ogg.ogg_sync_state()
+  sync:set_trusted(trusted, sample)
+  local readsize = 65536
+  local pages = 0
+  local start = os.clock()
+  for offset=1,#data,readsize do
+    sync:buffer(data, offset, math.min(readsize, #data - offset + 1))
+    while sync:pageout() do
+      pages = pages + 1
+    end
+  end
+  return os.clock() - start, pages
+end
+
+local data = make_stream(megabytes * 1024 * 1024)
+print(string.format('%d bytes, %d rounds', #data, rounds))
+
+local modes = {
+  { 'verified',         false, 0 },
+  { 'trusted',          true,  0 },
+  { 'trusted (1 in 16)', true, 16 },
+}
+
+for _,mode in ipairs(modes) do
+  local best, pages
+  for _=1,rounds do
+    local elapsed
+    elapsed, pages = run(data, mode[2], mode[3])
+    if not best or elapsed < best then
+      best = elapsed
+    end
+  end
+  print(string.format('%-18s %8d pages %8.3f s %8.1f MB/s',
+    mode[1], pages, best, #data / best / 1048576))
+end
@@ -8,6 +8,7 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <ogg/ogg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -18,6 +19,47 @@
 #define LUAOGG_PUBLIC
 #endif
 
+/* USDT probes, enabled with -DLUAOGG_USDT (the LUAOGG_USDT cmake option).
+ * when disabled they compile to nothing. when enabled, each probe has a
+ * semaphore that tracers increment while attached, and the probe's
+ * arguments are only evaluated while it's non-zero */
+#ifdef LUAOGG_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define LUAOGG_SEMAPHORE(name) \
+    volatile unsigned short luaogg_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+LUAOGG_SEMAPHORE(sync_buffer);
+LUAOGG_SEMAPHORE(sync_page);
+LUAOGG_SEMAPHORE(sync_skip);
+LUAOGG_SEMAPHORE(sync_resync);
+LUAOGG_SEMAPHORE(stream_pagein);
+LUAOGG_SEMAPHORE(stream_packetin);
+LUAOGG_SEMAPHORE(stream_packetout);
+LUAOGG_SEMAPHORE(stream_pageout);
+#define LUAOGG_PROBE_ENABLED(name)        __builtin_expect(luaogg_##name##_semaphore,0)
+#define LUAOGG_PROBE2(name,a,b) \
+    do { if(LUAOGG_PROBE_ENABLED(name)) DTRACE_PROBE2(luaogg,name,a,b); } while(0)
+#define LUAOGG_PROBE4(name,a,b,c,d) \
+    do { if(LUAOGG_PROBE_ENABLED(name)) DTRACE_PROBE4(luaogg,name,a,b,c,d); } while(0)
+#define LUAOGG_PROBE5(name,a,b,c,d,e) \
+    do { if(LUAOGG_PROBE_ENABLED(name)) DTRACE_PROBE5(luaogg,name,a,b,c,d,e); } while(0)
+#else
+#define LUAOGG_PROBE_ENABLED(name)        0
+#define LUAOGG_PROBE2(name,a,b)
+#define LUAOGG_PROBE4(name,a,b,c,d)
+#define LUAOGG_PROBE5(name,a,b,c,d,e)
+#endif
+
+#ifndef LUA_FILEHANDLE
+#define LUA_FILEHANDLE "FILE*"
+#endif
+
+/* bytes read from the input per fread/ogg_sync_buffer call in ogg.cut */
+#define LUAOGG_CUT_CHUNK 65536
+
+/* largest possible page: 27 byte header + 255 lacing values + 255*255 body */
+#define LUAOGG_MAX_PAGE (27 + 255 + (255 * 255))
+
 #if !defined(luaL_newlibtable) \
   && (!defined LUA_VERSION_NUM || LUA_VERSION_NUM==501)
 static void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
@@ -65,12 +107,92 @@ static const char * const luaogg_int64_mt        = "ogg_int64_t";
 static const char * const luaogg_uint64_mt       = "ogg_uint64_t";
 static const char * const luaogg_sync_state_mt   = "ogg_sync_state";
 static const char * const luaogg_stream_state_mt = "ogg_stream_state";
+static const char * const luaogg_header_cache_mt = "ogg_header_cache";
+static const char * const luaogg_codec_info_mt   = "ogg_codec_info";
+static const char * const luaogg_skeleton_mt     = "ogg_skeleton";
+static const char * const luaogg_stream_pool_mt  = "ogg_stream_pool";
 
 typedef struct luaogg_metamethods_s {
     const char *name;
     const char *metaname;
 } luaogg_metamethods;
 
+/* header pages (BOS pages and the setup pages that follow them) of the
+ * current link, stored back-to-back. once the first data page is seen the
+ * block is turned into a single Lua string kept in the registry */
+typedef struct luaogg_header_cache_s {
+    unsigned char *data;
+    size_t len;
+    size_t committed;
+    size_t storage;
+    /* pages up to committed */
+    lua_Integer committed_pages;
+    int headers;
+    int complete;
+    int ref;
+    lua_Integer pages;
+    lua_Integer generation;
+} luaogg_header_cache;
+
+enum luaogg_codec {
+    LUAOGG_CODEC_OPUS,
+    LUAOGG_CODEC_VORBIS,
+};
+
+/* what's needed to get the duration of a packet without decoding it. for
+ * Vorbis this depends on the previous packet, so it's stateful */
+typedef struct luaogg_codec_info_s {
+    enum luaogg_codec codec;
+    long rate;
+    int channels;
+    int preskip;
+    int blocksizes[2];
+    int mode_count;
+    int mode_bits;
+    unsigned char mode_blockflag[64];
+    int prev_blocksize;
+} luaogg_codec_info;
+
+/* the libogg structures are always the first member, so the userdata can
+ * be used directly as an ogg_sync_state/ogg_stream_state */
+typedef struct luaogg_sync_state_s {
+    ogg_sync_state state;
+    luaogg_header_cache *cache;
+    int cache_ref;
+    /* sorted serial numbers for the allow/deny filter */
+    ogg_uint32_t *serialnos;
+    size_t serialno_count;
+    int serialno_deny;
+    int filtering;
+    lua_Integer pages;
+    lua_Integer bytes;
+    lua_Integer skipped_pages;
+    lua_Integer skipped_bytes;
+    /* trusted input: frame pages without checking the CRC, except for
+     * every trusted_sample'th page */
+    int trusted;
+    lua_Integer trusted_sample;
+    lua_Integer trusted_count;
+} luaogg_sync_state;
+
+typedef struct luaogg_stream_state_s {
+    ogg_stream_state state;
+    luaogg_header_cache *cache;
+    int cache_ref;
+    luaogg_codec_info *codec;
+    int codec_ref;
+    ogg_int64_t granulepos;
+    /* flush policy limits, 0 means no limit */
+    int flush_policy;
+    long flush_bytes;
+    long flush_packets;
+    ogg_int64_t flush_granule_span;
+    /* granulepos of the last page handed out */
+    ogg_int64_t page_granulepos;
+    /* set while idle in a stream pool */
+    int pooled;
+} luaogg_stream_state;
+
 static char *
 luaogg_uint64_to_str(ogg_uint64_t value, char buffer[21], size_t *len) {
     char *p = buffer + 20;
@@ -156,6 +278,13 @@ luaogg_toint64(lua_State *L, int idx) {
     return tmp;
 }
 
+static void
+luaogg_pushint64(lua_State *L, ogg_int64_t value) {
+    ogg_int64_t *t = lua_newuserdata(L,sizeof(ogg_int64_t));
+    *t = value;
+    luaL_setmetatable(L,luaogg_int64_mt);
+}
+
 static void
 luaogg_page_to_table(lua_State *L, ogg_page *page) {
     ogg_int64_t *t = NULL;
@@ -564,250 +693,2759 @@ luaogg_int64__concat(lua_State *L) {
     return 1;
 }
 
+static void
+luaogg_header_cache_reset(lua_State *L, luaogg_header_cache *cache) {
+    luaL_unref(L,LUA_REGISTRYINDEX,cache->ref);
+    cache->ref = LUA_NOREF;
+    cache->len = 0;
+    cache->committed = 0;
+    cache->committed_pages = 0;
+    cache->headers = 0;
+    cache->complete = 0;
+    cache->pages = 0;
+    cache->generation++;
+}
+
+static void
+luaogg_header_cache_append(lua_State *L, luaogg_header_cache *cache, ogg_page *page) {
+    size_t len = page->header_len + page->body_len;
+    unsigned char *data = NULL;
+
+    if(cache->len + len > cache->storage) {
+        data = realloc(cache->data,cache->len + len);
+        if(data == NULL) {
+            luaL_error(L,"out of memory");
+            return;
+        }
+        cache->data = data;
+        cache->storage = cache->len + len;
+    }
+    memcpy(cache->data + cache->len,page->header,page->header_len);
+    memcpy(cache->data + cache->len + page->header_len,page->body,page->body_len);
+    cache->len += len;
+    cache->pages++;
+}
+
+/* looks at a page passing through a sync or stream state and collects it
+ * if it's a header page */
+static void
+luaogg_header_cache_page(lua_State *L, luaogg_header_cache *cache, ogg_page *page) {
+    ogg_int64_t granulepos = ogg_page_granulepos(page);
+
+    if(ogg_page_bos(page)) {
+        /* a BOS page after the BOS block starts a new chained link */
+        if(cache->complete || cache->headers) {
+            luaogg_header_cache_reset(L,cache);
+        }
+        luaogg_header_cache_append(L,cache,page);
+        cache->committed = cache->len;
+        cache->committed_pages = cache->pages;
+        return;
+    }
+
+    /* already complete, or joined mid-link and waiting for the next BOS */
+    if(cache->complete || cache->len == 0) {
+        return;
+    }
+
+    cache->headers = 1;
+    if(granulepos > 0) {
+        /* first data page - any pages where no packet finished belonged
+         * to this data packet, not the headers */
+        cache->len = cache->committed;
+        cache->pages = cache->committed_pages;
+        cache->complete = 1;
+        if(cache->storage > cache->len) {
+            unsigned char *data = realloc(cache->data,cache->len);
+            if(data != NULL) {
+                cache->data = data;
+                cache->storage = cache->len;
+            }
+        }
+        return;
+    }
+
+    luaogg_header_cache_append(L,cache,page);
+    if(granulepos == 0) {
+        cache->committed = cache->len;
+        cache->committed_pages = cache->pages;
+    }
+}
+
+static void
+luaogg_set_header_cache(lua_State *L, luaogg_header_cache **cache, int *ref) {
+    luaogg_header_cache *c = NULL;
+
+    if(!lua_isnoneornil(L,2)) {
+        c = luaL_checkudata(L,2,luaogg_header_cache_mt);
+    }
+
+    luaL_unref(L,LUA_REGISTRYINDEX,*ref);
+    *ref = LUA_NOREF;
+    *cache = c;
+
+    if(c != NULL) {
+        lua_pushvalue(L,2);
+        *ref = luaL_ref(L,LUA_REGISTRYINDEX);
+    }
+}
+
 static int
-luaogg_ogg_sync_state(lua_State *L) {
-    ogg_sync_state *state = lua_newuserdata(L,sizeof(ogg_sync_state));
-    if(state == NULL) {
+luaogg_header_cache_new(lua_State *L) {
+    luaogg_header_cache *cache = lua_newuserdata(L,sizeof(luaogg_header_cache));
+    if(cache == NULL) {
         return luaL_error(L,"out of memory");
     }
-    ogg_sync_init(state);
+    memset(cache,0,sizeof(luaogg_header_cache));
+    cache->ref = LUA_NOREF;
 
-    luaL_setmetatable(L,luaogg_sync_state_mt);
+    luaL_setmetatable(L,luaogg_header_cache_mt);
 
     return 1;
 }
 
 static int
-luaogg_ogg_stream_state(lua_State *L) {
-    ogg_stream_state *state = lua_newuserdata(L,sizeof(ogg_stream_state));
-    if(state == NULL) {
-        return luaL_error(L,"out of memory");
+luaogg_header_cache_pages(lua_State *L) {
+    luaogg_header_cache *cache = luaL_checkudata(L,1,luaogg_header_cache_mt);
+
+    if(!cache->complete) {
+        lua_pushnil(L);
+        return 1;
     }
 
-    luaL_setmetatable(L,luaogg_stream_state_mt);
+    if(cache->ref == LUA_NOREF) {
+        lua_pushlstring(L,(const char *)cache->data,cache->len);
+        lua_pushvalue(L,-1);
+        cache->ref = luaL_ref(L,LUA_REGISTRYINDEX);
+        /* the string is the only copy we need from here on */
+        free(cache->data);
+        cache->data = NULL;
+        cache->storage = 0;
+        return 1;
+    }
 
+    lua_rawgeti(L,LUA_REGISTRYINDEX,cache->ref);
     return 1;
 }
 
 static int
-luaogg_ogg_sync_init(lua_State *L) {
-    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
-    ogg_sync_init(state);
-    return 0;
+luaogg_header_cache_complete(lua_State *L) {
+    luaogg_header_cache *cache = luaL_checkudata(L,1,luaogg_header_cache_mt);
+    lua_pushboolean(L,cache->complete);
+    return 1;
 }
 
 static int
-luaogg_ogg_sync_check(lua_State *L) {
-    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
-    lua_pushboolean(L,ogg_sync_check(state) == 0);
+luaogg_header_cache_count(lua_State *L) {
+    luaogg_header_cache *cache = luaL_checkudata(L,1,luaogg_header_cache_mt);
+    lua_pushinteger(L,cache->complete ? cache->pages : 0);
     return 1;
 }
 
 static int
-luaogg_ogg_sync_clear(lua_State *L) {
-    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
-    ogg_sync_clear(state);
+luaogg_header_cache_generation(lua_State *L) {
+    luaogg_header_cache *cache = luaL_checkudata(L,1,luaogg_header_cache_mt);
+    lua_pushinteger(L,cache->generation);
+    return 1;
+}
+
+static int
+luaogg_header_cache_clear(lua_State *L) {
+    luaogg_header_cache *cache = luaL_checkudata(L,1,luaogg_header_cache_mt);
+    luaogg_header_cache_reset(L,cache);
     return 0;
 }
 
 static int
-luaogg_ogg_sync_reset(lua_State *L) {
-    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
-    lua_pushboolean(L,ogg_sync_reset(state) == 0);
-    return 1;
+luaogg_header_cache__gc(lua_State *L) {
+    luaogg_header_cache *cache = luaL_checkudata(L,1,luaogg_header_cache_mt);
+    luaL_unref(L,LUA_REGISTRYINDEX,cache->ref);
+    cache->ref = LUA_NOREF;
+    free(cache->data);
+    cache->data = NULL;
+    return 0;
 }
 
+/* returns the number of 48kHz samples in an Opus packet, from the TOC byte
+ * and frame count (RFC 6716, section 3.1), or -1 if it's malformed */
 static int
-luaogg_ogg_sync_buffer(lua_State *L) {
-    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
-    const char *data = NULL;
-    char *buffer = NULL;
-    size_t datalen = 0;
+luaogg_opus_packet_samples(const unsigned char *data, size_t len) {
+    int frames;
+    int size;
 
-    data = lua_tolstring(L,2,&datalen);
+    if(len == 0) {
+        return -1;
+    }
+    if(len >= 8 && (memcmp(data,"OpusHead",8) == 0 || memcmp(data,"OpusTags",8) == 0)) {
+        return 0;
+    }
 
-    buffer = ogg_sync_buffer(state,datalen);
-    if(buffer == NULL) {
-        return luaL_error(L,"ogg_sync_buffer error");
+    switch(data[0] & 0x03) {
+        case 0: frames = 1; break;
+        case 3: {
+            if(len < 2) {
+                return -1;
+            }
+            frames = data[1] & 0x3F;
+            if(frames == 0) {
+                return -1;
+            }
+            break;
+        }
+        default: frames = 2; break;
     }
 
-    memcpy(buffer,data,datalen);
+    if(data[0] & 0x80) {
+        /* CELT-only: 2.5, 5, 10, 20ms */
+        size = 120 << ((data[0] >> 3) & 0x03);
+    }
+    else if((data[0] & 0x60) == 0x60) {
+        /* hybrid: 10, 20ms */
+        size = (data[0] & 0x08) ? 960 : 480;
+    }
+    else {
+        /* SILK-only: 10, 20, 40, 60ms */
+        size = (data[0] >> 3) & 0x03;
+        size = size == 3 ? 2880 : 480 << size;
+    }
 
-    lua_pushboolean(L,ogg_sync_wrote(state,datalen) == 0);
-    return 1;
+    /* at most 120ms per packet */
+    if(frames * size > 5760) {
+        return -1;
+    }
+    return frames * size;
 }
 
+/* returns the number of samples a Vorbis audio packet adds: a quarter of
+ * the previous block plus a quarter of this one. header packets and the
+ * first audio packet don't produce any samples */
 static int
-luaogg_ogg_sync_pageseek(lua_State *L) {
-    ogg_page page;
-    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
-    if(ogg_sync_pageseek(state,&page) > 0) {
-        luaogg_page_to_table(L,&page);
+luaogg_vorbis_packet_samples(luaogg_codec_info *info, const unsigned char *data, size_t len) {
+    int mode;
+    int blocksize;
+    int samples = 0;
+
+    if(len == 0) {
+        return 0;
     }
-    else {
-        lua_pushnil(L);
+    if(data[0] & 0x01) {
+        return 0;
     }
-    return 1;
-}
 
-static int
-luaogg_ogg_sync_pageout(lua_State *L) {
-    ogg_page page;
-    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
-    if(ogg_sync_pageout(state,&page) > 0) {
-        luaogg_page_to_table(L,&page);
+    mode = (data[0] >> 1) & ((1 << info->mode_bits) - 1);
+    if(mode >= info->mode_count) {
+        return -1;
     }
-    else {
-        lua_pushnil(L);
+
+    blocksize = info->blocksizes[info->mode_blockflag[mode]];
+    if(info->prev_blocksize) {
+        samples = (info->prev_blocksize + blocksize) / 4;
     }
-    return 1;
+    info->prev_blocksize = blocksize;
+    return samples;
 }
 
 static int
-luaogg_ogg_stream_init(lua_State *L) {
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
-    lua_pushboolean(L,ogg_stream_init(state,luaL_checkinteger(L,2)) == 0);
-    return 1;
+luaogg_codec_packet_samples(luaogg_codec_info *info, const unsigned char *data, size_t len) {
+    switch(info->codec) {
+        case LUAOGG_CODEC_OPUS: return luaogg_opus_packet_samples(data,len);
+        case LUAOGG_CODEC_VORBIS: return luaogg_vorbis_packet_samples(info,data,len);
+    }
+    return -1;
 }
 
+/* reads a bit from the end of a Vorbis packet, walking backwards */
 static int
-luaogg_ogg_stream_check(lua_State *L) {
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
-    lua_pushboolean(L,ogg_stream_check(state) == 0);
-    return 1;
+luaogg_vorbis_bit(const unsigned char *data, size_t *pos) {
+    *pos -= 1;
+    return (data[*pos >> 3] >> (*pos & 7)) & 0x01;
 }
 
-static int
-luaogg_ogg_stream_clear(lua_State *L) {
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
-    ogg_stream_clear(state);
-    return 0;
+static unsigned int
+luaogg_vorbis_bits(const unsigned char *data, size_t *pos, int bits) {
+    unsigned int value = 0;
+    while(bits--) {
+        value = (value << 1) | luaogg_vorbis_bit(data,pos);
+    }
+    return value;
 }
 
+/* the mode configurations are the last thing in the setup header, so
+ * they're read from the end backwards instead of walking the codebooks,
+ * floors, residues and mappings in front of them. each mode is a 1-bit
+ * blockflag, two 16-bit zero fields and an 8-bit mapping, preceded by a
+ * 6-bit mode count - the count is where that field matches the number of
+ * modes read so far */
 static int
-luaogg_ogg_stream_reset(lua_State *L) {
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
-    lua_pushboolean(L,ogg_stream_reset(state) == 0);
-    return 1;
+luaogg_vorbis_parse_modes(luaogg_codec_info *info, const unsigned char *data, size_t len) {
+    size_t pos = len * 8;
+    size_t framing;
+    size_t peek;
+    int count = 0;
+    int mode_count = 0;
+    int i;
+
+    if(len < 7 || data[0] != 0x05 || memcmp(data + 1,"vorbis",6) != 0) {
+        return -1;
+    }
+
+    while(pos > 7 * 8 && !luaogg_vorbis_bit(data,&pos));
+    framing = pos;
+
+    while(pos >= 7 * 8 + 41 + 6) {
+        if(luaogg_vorbis_bits(data,&pos,8) > 63 ||
+           luaogg_vorbis_bits(data,&pos,16) ||
+           luaogg_vorbis_bits(data,&pos,16)) {
+            break;
+        }
+        luaogg_vorbis_bit(data,&pos);
+        if(++count > 64) {
+            break;
+        }
+        peek = pos;
+        if(luaogg_vorbis_bits(data,&peek,6) + 1 == (unsigned int)count) {
+            mode_count = count;
+        }
+    }
+
+    if(mode_count == 0) {
+        return -1;
+    }
+
+    pos = framing;
+    for(i = mode_count - 1; i >= 0; i--) {
+        pos -= 40;
+        info->mode_blockflag[i] = luaogg_vorbis_bit(data,&pos);
+    }
+
+    info->mode_count = mode_count;
+    info->mode_bits = 0;
+    for(i = mode_count - 1; i > 0; i >>= 1) {
+        info->mode_bits++;
+    }
+    return 0;
 }
 
-static int
-luaogg_ogg_stream_reset_serialno(lua_State *L) {
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
-    lua_pushboolean(L,ogg_stream_reset_serialno(state,lua_tointeger(L,2)) == 0);
-    return 1;
+static const unsigned char *
+luaogg_checkpacketdata(lua_State *L, int idx, size_t *len) {
+    const unsigned char *data = NULL;
+
+    if(lua_istable(L,idx)) {
+        lua_getfield(L,idx,"packet");
+        data = (const unsigned char *)lua_tolstring(L,-1,len);
+        lua_pop(L,1);
+    }
+    else {
+        data = (const unsigned char *)lua_tolstring(L,idx,len);
+    }
+    if(data == NULL) {
+        luaL_argerror(L,idx,"expected a packet or string");
+    }
+    return data;
 }
 
-static int
-luaogg_ogg_stream_pagein(lua_State *L) {
-    ogg_page page;
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+static luaogg_codec_info *
+luaogg_codec_info_new(lua_State *L, enum luaogg_codec codec) {
+    luaogg_codec_info *info = lua_newuserdata(L,sizeof(luaogg_codec_info));
+    if(info == NULL) {
+        luaL_error(L,"out of memory");
+        return NULL;
+    }
+    memset(info,0,sizeof(luaogg_codec_info));
+    info->codec = codec;
 
-    luaogg_table_to_page(L,2,&page);
+    luaL_setmetatable(L,luaogg_codec_info_mt);
 
-    lua_pushboolean(L,ogg_stream_pagein(state,&page) == 0);
-    return 1;
+    return info;
 }
 
 static int
-luaogg_ogg_stream_pageout(lua_State *L) {
-    ogg_page page;
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+luaogg_opus_info(lua_State *L) {
+    luaogg_codec_info *info = NULL;
+    const unsigned char *data = NULL;
+    size_t len = 0;
 
-    if(ogg_stream_pageout(state,&page) != 0) {
-        luaogg_page_to_table(L,&page);
-    }
-    else {
+    data = luaogg_checkpacketdata(L,1,&len);
+    if(len < 19 || memcmp(data,"OpusHead",8) != 0) {
         lua_pushnil(L);
+        return 1;
     }
+
+    info = luaogg_codec_info_new(L,LUAOGG_CODEC_OPUS);
+    info->channels = data[9];
+    info->preskip = data[10] | (data[11] << 8);
+    /* the granulepos is always in 48kHz samples, the header's rate is
+     * only the rate of the original input */
+    info->rate = 48000;
+
     return 1;
 }
 
 static int
-luaogg_ogg_stream_pageout_fill(lua_State *L) {
-    ogg_page page;
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+luaogg_vorbis_info(lua_State *L) {
+    luaogg_codec_info *info = NULL;
+    const unsigned char *ident = NULL;
+    const unsigned char *setup = NULL;
+    size_t ident_len = 0;
+    size_t setup_len = 0;
+    int bs0;
+    int bs1;
+
+    ident = luaogg_checkpacketdata(L,1,&ident_len);
+    setup = luaogg_checkpacketdata(L,2,&setup_len);
+
+    if(ident_len < 30 || ident[0] != 0x01 || memcmp(ident + 1,"vorbis",6) != 0) {
+        lua_pushnil(L);
+        return 1;
+    }
 
-    if(ogg_stream_pageout_fill(state,&page,luaL_checkinteger(L,2)) != 0) {
-        luaogg_page_to_table(L,&page);
+    bs0 = ident[28] & 0x0F;
+    bs1 = ident[28] >> 4;
+    if(bs0 < 6 || bs1 > 13 || bs0 > bs1) {
+        lua_pushnil(L);
+        return 1;
     }
-    else {
+
+    info = luaogg_codec_info_new(L,LUAOGG_CODEC_VORBIS);
+    info->channels = ident[11];
+    info->rate = (long)((ogg_uint32_t)ident[12] | ((ogg_uint32_t)ident[13] << 8) |
+      ((ogg_uint32_t)ident[14] << 16) | ((ogg_uint32_t)ident[15] << 24));
+    info->blocksizes[0] = 1 << bs0;
+    info->blocksizes[1] = 1 << bs1;
+
+    if(luaogg_vorbis_parse_modes(info,setup,setup_len) != 0) {
         lua_pushnil(L);
     }
     return 1;
 }
 
 static int
-luaogg_ogg_stream_flush(lua_State *L) {
-    ogg_page page;
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
-
-    if(ogg_stream_flush(state,&page) != 0) {
-        luaogg_page_to_table(L,&page);
+luaogg_opus_packet_samples_lua(lua_State *L) {
+    const unsigned char *data = NULL;
+    size_t len = 0;
+    int samples;
+
+    data = luaogg_checkpacketdata(L,1,&len);
+    samples = luaogg_opus_packet_samples(data,len);
+    if(samples < 0) {
+        lua_pushnil(L);
     }
     else {
-        lua_pushnil(L);
+        lua_pushinteger(L,samples);
     }
     return 1;
 }
 
 static int
-luaogg_ogg_stream_flush_fill(lua_State *L) {
-    ogg_page page;
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
-
-    if(ogg_stream_flush_fill(state,&page,luaL_checkinteger(L,2)) != 0) {
-        luaogg_page_to_table(L,&page);
+luaogg_codec_info_packet_samples(lua_State *L) {
+    luaogg_codec_info *info = luaL_checkudata(L,1,luaogg_codec_info_mt);
+    const unsigned char *data = NULL;
+    size_t len = 0;
+    int samples;
+
+    data = luaogg_checkpacketdata(L,2,&len);
+    samples = luaogg_codec_packet_samples(info,data,len);
+    if(samples < 0) {
+        lua_pushnil(L);
     }
     else {
-        lua_pushnil(L);
+        lua_pushinteger(L,samples);
     }
     return 1;
 }
 
+/* takes an array of packets (tables or strings), returns an array of
+ * sample counts (false for malformed packets) and the total */
 static int
-luaogg_ogg_stream_packetin(lua_State *L) {
-    ogg_packet packet;
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+luaogg_codec_info_packets_samples(lua_State *L) {
+    luaogg_codec_info *info = luaL_checkudata(L,1,luaogg_codec_info_mt);
+    const unsigned char *data = NULL;
+    size_t len = 0;
+    size_t i;
+    size_t count;
+    int samples;
+    ogg_int64_t total = 0;
+
+    luaL_checktype(L,2,LUA_TTABLE);
+#if LUA_VERSION_NUM >= 502
+    count = lua_rawlen(L,2);
+#else
+    count = lua_objlen(L,2);
+#endif
 
-    luaogg_table_to_packet(L, 2, &packet);
+    lua_createtable(L,(int)count,0);
+    for(i=1;i<=count;i++) {
+        lua_rawgeti(L,2,i);
+        data = luaogg_checkpacketdata(L,-1,&len);
+        samples = luaogg_codec_packet_samples(info,data,len);
+        lua_pop(L,1);
+        if(samples < 0) {
+            lua_pushboolean(L,0);
+        }
+        else {
+            lua_pushinteger(L,samples);
+            total += samples;
+        }
+        lua_rawseti(L,-2,i);
+    }
 
-    lua_pushboolean(L,ogg_stream_packetin(state,&packet) == 0);
-    return 1;
+    luaogg_pushint64(L,total);
+    return 2;
 }
 
 static int
-luaogg_ogg_stream_packetout(lua_State *L) {
-    ogg_packet packet;
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
-    if(ogg_stream_packetout(state,&packet) == 1) {
-        luaogg_packet_to_table(L,&packet);
+luaogg_codec_info_reset(lua_State *L) {
+    luaogg_codec_info *info = luaL_checkudata(L,1,luaogg_codec_info_mt);
+    info->prev_blocksize = 0;
+    return 0;
+}
+
+static int
+luaogg_codec_info__index(lua_State *L) {
+    luaogg_codec_info *info = luaL_checkudata(L,1,luaogg_codec_info_mt);
+    const char *key = luaL_checkstring(L,2);
+
+    if(strcmp(key,"codec") == 0) {
+        lua_pushstring(L,info->codec == LUAOGG_CODEC_OPUS ? "opus" : "vorbis");
+    }
+    else if(strcmp(key,"rate") == 0) {
+        lua_pushinteger(L,info->rate);
+    }
+    else if(strcmp(key,"channels") == 0) {
+        lua_pushinteger(L,info->channels);
+    }
+    else if(strcmp(key,"preskip") == 0) {
+        lua_pushinteger(L,info->preskip);
+    }
+    else if(strcmp(key,"blocksize_0") == 0 && info->codec == LUAOGG_CODEC_VORBIS) {
+        lua_pushinteger(L,info->blocksizes[0]);
+    }
+    else if(strcmp(key,"blocksize_1") == 0 && info->codec == LUAOGG_CODEC_VORBIS) {
+        lua_pushinteger(L,info->blocksizes[1]);
     }
     else {
-        lua_pushnil(L);
+        lua_getmetatable(L,1);
+        lua_getfield(L,-1,"methods");
+        lua_getfield(L,-1,key);
     }
     return 1;
 }
 
 static int
-luaogg_ogg_stream_packetpeek(lua_State *L) {
-    ogg_packet packet;
-    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
-    if(ogg_stream_packetpeek(state,&packet) == 1) {
-        luaogg_packet_to_table(L,&packet);
+luaogg_ogg_sync_state(lua_State *L) {
+    luaogg_sync_state *state = lua_newuserdata(L,sizeof(luaogg_sync_state));
+    if(state == NULL) {
+        return luaL_error(L,"out of memory");
     }
-    else {
-        lua_pushnil(L);
+    memset(state,0,sizeof(luaogg_sync_state));
+    ogg_sync_init(&state->state);
+    state->cache_ref = LUA_NOREF;
+
+    luaL_setmetatable(L,luaogg_sync_state_mt);
+
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_state(lua_State *L) {
+    luaogg_stream_state *state = lua_newuserdata(L,sizeof(luaogg_stream_state));
+    if(state == NULL) {
+        return luaL_error(L,"out of memory");
     }
+    /* zeroed so clearing a never-initialized state is safe */
+    memset(state,0,sizeof(luaogg_stream_state));
+    state->cache_ref = LUA_NOREF;
+    state->codec_ref = LUA_NOREF;
+    state->page_granulepos = -1;
+
+    luaL_setmetatable(L,luaogg_stream_state_mt);
+
     return 1;
 }
 
-static const struct luaL_Reg luaogg_int64_metamethods[] = {
-    { "__add",      luaogg_int64__add      },
-    { "__sub",      luaogg_int64__sub      },
-    { "__mul",      luaogg_int64__mul      },
-    { "__div",      luaogg_int64__div      },
-    { "__idiv",     luaogg_int64__div      },
+static int
+luaogg_ogg_sync_state__gc(lua_State *L) {
+    luaogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    ogg_sync_clear(&state->state);
+    luaL_unref(L,LUA_REGISTRYINDEX,state->cache_ref);
+    state->cache_ref = LUA_NOREF;
+    state->cache = NULL;
+    free(state->serialnos);
+    state->serialnos = NULL;
+    state->serialno_count = 0;
+    state->filtering = 0;
+    return 0;
+}
+
+static int
+luaogg_ogg_stream_state__gc(lua_State *L) {
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    ogg_stream_clear(&state->state);
+    luaL_unref(L,LUA_REGISTRYINDEX,state->cache_ref);
+    state->cache_ref = LUA_NOREF;
+    state->cache = NULL;
+    luaL_unref(L,LUA_REGISTRYINDEX,state->codec_ref);
+    state->codec_ref = LUA_NOREF;
+    state->codec = NULL;
+    return 0;
+}
+
+static int
+luaogg_ogg_sync_set_header_cache(lua_State *L) {
+    luaogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    luaogg_set_header_cache(L,&state->cache,&state->cache_ref);
+    return 0;
+}
+
+static int
+luaogg_ogg_stream_set_header_cache(lua_State *L) {
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    luaogg_set_header_cache(L,&state->cache,&state->cache_ref);
+    return 0;
+}
+
+static int
+luaogg_ogg_stream_set_granule_codec(lua_State *L) {
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    luaogg_codec_info *codec = NULL;
+
+    if(!lua_isnoneornil(L,2)) {
+        codec = luaL_checkudata(L,2,luaogg_codec_info_mt);
+    }
+
+    luaL_unref(L,LUA_REGISTRYINDEX,state->codec_ref);
+    state->codec_ref = LUA_NOREF;
+    state->codec = codec;
+    state->granulepos = luaogg_toint64(L,3);
+
+    if(codec != NULL) {
+        lua_pushvalue(L,2);
+        state->codec_ref = luaL_ref(L,LUA_REGISTRYINDEX);
+    }
+    return 0;
+}
+
+/* pushes a page produced by a stream state as a table */
+static void
+luaogg_stream_push_page(lua_State *L, luaogg_stream_state *state, ogg_page *page) {
+    ogg_int64_t granulepos = ogg_page_granulepos(page);
+
+    LUAOGG_PROBE4(stream_pageout,ogg_page_serialno(page),ogg_page_pageno(page),
+      granulepos,page->header_len + page->body_len);
+
+    if(granulepos != -1) {
+        state->page_granulepos = granulepos;
+    }
+    if(state->cache != NULL) {
+        luaogg_header_cache_page(L,state->cache,page);
+    }
+    luaogg_page_to_table(L,page);
+}
+
+static int
+luaogg_ogg_stream_set_flush_policy(lua_State *L) {
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+
+    state->flush_policy = 0;
+    state->flush_bytes = 0;
+    state->flush_packets = 0;
+    state->flush_granule_span = 0;
+
+    if(lua_isnoneornil(L,2)) {
+        return 0;
+    }
+    luaL_checktype(L,2,LUA_TTABLE);
+
+    lua_getfield(L,2,"max_bytes");
+    state->flush_bytes = (long)lua_tointeger(L,-1);
+    lua_getfield(L,2,"max_packets");
+    state->flush_packets = (long)lua_tointeger(L,-1);
+    lua_getfield(L,2,"max_granule_span");
+    state->flush_granule_span = luaogg_toint64(L,-1);
+    lua_pop(L,3);
+
+    state->flush_policy = state->flush_bytes > 0 || state->flush_packets > 0 ||
+      state->flush_granule_span > 0;
+    return 0;
+}
+
+/* checks the data waiting to be paged against the flush policy */
+static int
+luaogg_stream_flush_due(luaogg_stream_state *state, ogg_int64_t granulepos) {
+    ogg_stream_state *os = &state->state;
+    long packets = 0;
+    long i;
+
+    if(os->lacing_fill == 0) {
+        return 0;
+    }
+
+    if(state->flush_bytes > 0 && os->body_fill - os->body_returned >= state->flush_bytes) {
+        return 1;
+    }
+
+    if(state->flush_granule_span > 0 && granulepos >= 0 && state->page_granulepos >= 0 &&
+       granulepos - state->page_granulepos >= state->flush_granule_span) {
+        return 1;
+    }
+
+    if(state->flush_packets > 0) {
+        for(i=0;i<os->lacing_fill;i++) {
+            if((os->lacing_vals[i] & 0xFF) < 255) {
+                packets++;
+            }
+        }
+        if(packets >= state->flush_packets) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* after a packetin, hands out any pages libogg would produce on its own,
+ * then flushes everything if the policy says so. pages are collected into
+ * an array, which is only created if there's a page */
+static int
+luaogg_stream_policy_pageout(lua_State *L, luaogg_stream_state *state, ogg_int64_t granulepos) {
+    ogg_page page;
+    int count = 0;
+
+    while(ogg_stream_pageout(&state->state,&page) != 0) {
+        if(count == 0) {
+            lua_newtable(L);
+        }
+        luaogg_stream_push_page(L,state,&page);
+        lua_rawseti(L,-2,++count);
+    }
+
+    if(luaogg_stream_flush_due(state,granulepos)) {
+        while(ogg_stream_flush(&state->state,&page) != 0) {
+            if(count == 0) {
+                lua_newtable(L);
+            }
+            luaogg_stream_push_page(L,state,&page);
+            lua_rawseti(L,-2,++count);
+        }
+    }
+
+    return count > 0;
+}
+
+static int
+luaogg_ogg_sync_init(lua_State *L) {
+    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    ogg_sync_init(state);
+    return 0;
+}
+
+static int
+luaogg_ogg_sync_check(lua_State *L) {
+    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    lua_pushboolean(L,ogg_sync_check(state) == 0);
+    return 1;
+}
+
+static int
+luaogg_ogg_sync_clear(lua_State *L) {
+    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    ogg_sync_clear(state);
+    return 0;
+}
+
+static int
+luaogg_ogg_sync_reset(lua_State *L) {
+    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    lua_pushboolean(L,ogg_sync_reset(state) == 0);
+    return 1;
+}
+
+static int
+luaogg_ogg_sync_buffer(lua_State *L) {
+    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    const char *data = NULL;
+    char *buffer = NULL;
+    size_t datalen = 0;
+    lua_Integer offset;
+    lua_Integer len;
+
+    data = lua_tolstring(L,2,&datalen);
+
+    /* optional slice of the string, so callers don't need string.sub */
+    if(!lua_isnoneornil(L,3) || !lua_isnoneornil(L,4)) {
+        offset = luaL_optinteger(L,3,1);
+        luaL_argcheck(L,offset >= 1 && (size_t)offset <= datalen + 1,3,"offset out of range");
+        len = luaL_optinteger(L,4,(lua_Integer)datalen - offset + 1);
+        luaL_argcheck(L,len >= 0 && (size_t)len <= datalen - (size_t)(offset - 1),4,"length out of range");
+        data += offset - 1;
+        datalen = (size_t)len;
+    }
+
+    buffer = ogg_sync_buffer(state,datalen);
+    if(buffer == NULL) {
+        return luaL_error(L,"ogg_sync_buffer error");
+    }
+
+    memcpy(buffer,data,datalen);
+    LUAOGG_PROBE2(sync_buffer,(long)datalen,(long)state->fill);
+
+    lua_pushboolean(L,ogg_sync_wrote(state,datalen) == 0);
+    return 1;
+}
+
+static int
+luaogg_ogg_sync_buffer_many(lua_State *L) {
+    ogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    const char *data = NULL;
+    char *buffer = NULL;
+    size_t datalen = 0;
+    size_t total = 0;
+    size_t count;
+    size_t i;
+
+    luaL_checktype(L,2,LUA_TTABLE);
+#if LUA_VERSION_NUM >= 502
+    count = lua_rawlen(L,2);
+#else
+    count = lua_objlen(L,2);
+#endif
+
+    for(i=1;i<=count;i++) {
+        lua_rawgeti(L,2,i);
+        if(lua_type(L,-1) != LUA_TSTRING) {
+            return luaL_argerror(L,2,"chunks must be strings");
+        }
+        lua_tolstring(L,-1,&datalen);
+        total += datalen;
+        lua_pop(L,1);
+    }
+
+    /* one reservation and one ogg_sync_wrote for every chunk */
+    buffer = ogg_sync_buffer(state,total);
+    if(buffer == NULL) {
+        return luaL_error(L,"ogg_sync_buffer error");
+    }
+
+    for(i=1;i<=count;i++) {
+        lua_rawgeti(L,2,i);
+        data = lua_tolstring(L,-1,&datalen);
+        memcpy(buffer,data,datalen);
+        buffer += datalen;
+        lua_pop(L,1);
+    }
+    LUAOGG_PROBE2(sync_buffer,(long)total,(long)state->fill);
+
+    lua_pushboolean(L,ogg_sync_wrote(state,total) == 0);
+    return 1;
+}
+
+static int
+luaogg_serialno_cmp(const void *a, const void *b) {
+    ogg_uint32_t x = *(const ogg_uint32_t *)a;
+    ogg_uint32_t y = *(const ogg_uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int
+luaogg_sync_wanted(luaogg_sync_state *state, ogg_page *page) {
+    ogg_uint32_t serialno;
+    int found;
+
+    if(!state->filtering) {
+        return 1;
+    }
+    serialno = (ogg_uint32_t)ogg_page_serialno(page);
+    found = bsearch(&serialno,state->serialnos,state->serialno_count,
+      sizeof(ogg_uint32_t),luaogg_serialno_cmp) != NULL;
+    return found != state->serialno_deny;
+}
+
+/* frames the page at the current sync position from the capture pattern
+ * and segment table alone, skipping the CRC check. returns the page size,
+ * or 0 if there isn't a complete page right at the current position */
+static long
+luaogg_sync_trusted_pageseek(ogg_sync_state *oy, ogg_page *page) {
+    unsigned char *p = NULL;
+    long bytes = oy->fill - oy->returned;
+    long header_len;
+    long body_len = 0;
+    int i;
+
+    if(oy->storage < 0 || bytes < 27) {
+        return 0;
+    }
+    p = oy->data + oy->returned;
+    if(memcmp(p,"OggS",4) != 0) {
+        return 0;
+    }
+
+    header_len = 27 + p[26];
+    if(bytes < header_len) {
+        return 0;
+    }
+    for(i=0;i<p[26];i++) {
+        body_len += p[27 + i];
+    }
+    if(bytes < header_len + body_len) {
+        return 0;
+    }
+
+    page->header = p;
+    page->header_len = header_len;
+    page->body = p + header_len;
+    page->body_len = body_len;
+
+    /* same bookkeeping ogg_sync_pageseek does for a found page */
+    oy->unsynced = 0;
+    oy->headerbytes = 0;
+    oy->bodybytes = 0;
+    oy->returned += header_len + body_len;
+    return header_len + body_len;
+}
+
+/* gets the next page that passes the serial number filter, pages that
+ * don't pass are dropped here without ever being turned into tables.
+ * returns the same values as ogg_sync_pageseek/ogg_sync_pageout */
+static long
+luaogg_sync_page(luaogg_sync_state *state, ogg_page *page, int seek) {
+    long r;
+    int sampled;
+
+    for(;;) {
+        r = 0;
+        sampled = 0;
+        if(state->trusted) {
+            if(state->trusted_sample > 0 && state->trusted_count >= state->trusted_sample - 1) {
+                /* let libogg verify this one. the count is only reset once
+                 * libogg returns a page, so a sample that lands on the end
+                 * of the buffer is retried on the next call */
+                sampled = 1;
+            }
+            else {
+                r = luaogg_sync_trusted_pageseek(&state->state,page);
+                if(r > 0) {
+                    state->trusted_count++;
+                }
+            }
+        }
+        /* anything that isn't a complete page at the current position
+         * (including resyncing) goes through libogg */
+        if(r == 0) {
+            if(seek) {
+                r = ogg_sync_pageseek(&state->state,page);
+            }
+            else {
+                r = ogg_sync_pageout(&state->state,page);
+            }
+            if(sampled && r > 0) {
+                state->trusted_count = 0;
+            }
+        }
+        if(r < 0) {
+            /* bytes skipped while looking for the next page */
+            LUAOGG_PROBE2(sync_resync,seek ? -r : -1,(long)state->state.returned);
+        }
+        if(r <= 0) {
+            return r;
+        }
+
+        state->pages++;
+        state->bytes += page->header_len + page->body_len;
+        if(luaogg_sync_wanted(state,page)) {
+            LUAOGG_PROBE5(sync_page,ogg_page_serialno(page),ogg_page_pageno(page),
+              ogg_page_granulepos(page),page->header_len + page->body_len,seek);
+            return r;
+        }
+        LUAOGG_PROBE4(sync_skip,ogg_page_serialno(page),ogg_page_pageno(page),
+          ogg_page_granulepos(page),page->header_len + page->body_len);
+        state->skipped_pages++;
+        state->skipped_bytes += page->header_len + page->body_len;
+    }
+}
+
+static int
+luaogg_ogg_sync_set_serialno_filter(lua_State *L) {
+    static const char * const modes[] = { "allow", "deny", NULL };
+    luaogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    ogg_uint32_t *serialnos = NULL;
+    size_t count = 0;
+    size_t i;
+    int deny;
+
+    deny = luaL_checkoption(L,3,"allow",modes);
+
+    if(!lua_isnoneornil(L,2)) {
+        luaL_checktype(L,2,LUA_TTABLE);
+#if LUA_VERSION_NUM >= 502
+        count = lua_rawlen(L,2);
+#else
+        count = lua_objlen(L,2);
+#endif
+        /* check everything before allocating so an error can't leak */
+        for(i=1;i<=count;i++) {
+            lua_rawgeti(L,2,i);
+            if(!lua_isnumber(L,-1)) {
+                return luaL_argerror(L,2,"serial numbers must be numbers");
+            }
+            lua_pop(L,1);
+        }
+        if(count > 0) {
+            serialnos = malloc(sizeof(ogg_uint32_t) * count);
+            if(serialnos == NULL) {
+                return luaL_error(L,"out of memory");
+            }
+        }
+        for(i=1;i<=count;i++) {
+            lua_rawgeti(L,2,i);
+            serialnos[i-1] = (ogg_uint32_t)lua_tointeger(L,-1);
+            lua_pop(L,1);
+        }
+        if(count > 0) {
+            qsort(serialnos,count,sizeof(ogg_uint32_t),luaogg_serialno_cmp);
+        }
+    }
+
+    free(state->serialnos);
+    state->serialnos = serialnos;
+    state->serialno_count = count;
+    state->serialno_deny = deny;
+    state->filtering = !lua_isnoneornil(L,2);
+    return 0;
+}
+
+static int
+luaogg_ogg_sync_set_trusted(lua_State *L) {
+    luaogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    lua_Integer sample = luaL_optinteger(L,3,0);
+
+    luaL_argcheck(L,sample >= 0,3,"sample rate must not be negative");
+
+    state->trusted = lua_toboolean(L,2);
+    state->trusted_sample = sample;
+    state->trusted_count = 0;
+    return 0;
+}
+
+static int
+luaogg_ogg_sync_stats(lua_State *L) {
+    luaogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+
+    lua_newtable(L);
+    lua_pushinteger(L,state->pages);
+    lua_setfield(L,-2,"pages");
+    lua_pushinteger(L,state->bytes);
+    lua_setfield(L,-2,"bytes");
+    lua_pushinteger(L,state->skipped_pages);
+    lua_setfield(L,-2,"skipped_pages");
+    lua_pushinteger(L,state->skipped_bytes);
+    lua_setfield(L,-2,"skipped_bytes");
+    return 1;
+}
+
+static int
+luaogg_ogg_sync_pageseek(lua_State *L) {
+    ogg_page page;
+    luaogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    if(luaogg_sync_page(state,&page,1) > 0) {
+        if(state->cache != NULL) {
+            luaogg_header_cache_page(L,state->cache,&page);
+        }
+        luaogg_page_to_table(L,&page);
+    }
+    else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int
+luaogg_ogg_sync_pageout(lua_State *L) {
+    ogg_page page;
+    luaogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    if(luaogg_sync_page(state,&page,0) > 0) {
+        if(state->cache != NULL) {
+            luaogg_header_cache_page(L,state->cache,&page);
+        }
+        luaogg_page_to_table(L,&page);
+    }
+    else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_init(lua_State *L) {
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    state->page_granulepos = -1;
+    lua_pushboolean(L,ogg_stream_init(&state->state,luaL_checkinteger(L,2)) == 0);
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_check(lua_State *L) {
+    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    lua_pushboolean(L,ogg_stream_check(state) == 0);
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_clear(lua_State *L) {
+    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    ogg_stream_clear(state);
+    return 0;
+}
+
+static int
+luaogg_ogg_stream_reset(lua_State *L) {
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    state->page_granulepos = -1;
+    lua_pushboolean(L,ogg_stream_reset(&state->state) == 0);
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_reset_serialno(lua_State *L) {
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    state->page_granulepos = -1;
+    lua_pushboolean(L,ogg_stream_reset_serialno(&state->state,lua_tointeger(L,2)) == 0);
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_pagein(lua_State *L) {
+    ogg_page page;
+    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    int r;
+
+    luaogg_table_to_page(L,2,&page);
+
+    r = ogg_stream_pagein(state,&page);
+    LUAOGG_PROBE5(stream_pagein,ogg_page_serialno(&page),ogg_page_pageno(&page),
+      ogg_page_granulepos(&page),page.header_len + page.body_len,r);
+
+    lua_pushboolean(L,r == 0);
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_pageout(lua_State *L) {
+    ogg_page page;
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+
+    if(ogg_stream_pageout(&state->state,&page) != 0) {
+        luaogg_stream_push_page(L,state,&page);
+    }
+    else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_pageout_fill(lua_State *L) {
+    ogg_page page;
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+
+    if(ogg_stream_pageout_fill(&state->state,&page,luaL_checkinteger(L,2)) != 0) {
+        luaogg_stream_push_page(L,state,&page);
+    }
+    else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_flush(lua_State *L) {
+    ogg_page page;
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+
+    if(ogg_stream_flush(&state->state,&page) != 0) {
+        luaogg_stream_push_page(L,state,&page);
+    }
+    else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_flush_fill(lua_State *L) {
+    ogg_page page;
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+
+    if(ogg_stream_flush_fill(&state->state,&page,luaL_checkinteger(L,2)) != 0) {
+        luaogg_stream_push_page(L,state,&page);
+    }
+    else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_packetin(lua_State *L) {
+    ogg_packet packet;
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    int samples;
+
+    luaogg_table_to_packet(L, 2, &packet);
+
+    if(state->codec != NULL) {
+        /* always run the packet through the codec, Vorbis needs to see
+         * every packet to know the previous blocksize */
+        samples = luaogg_codec_packet_samples(state->codec,packet.packet,packet.bytes);
+        lua_getfield(L,2,"granulepos");
+        if(lua_isnil(L,-1)) {
+            if(samples > 0) {
+                state->granulepos += samples;
+            }
+            packet.granulepos = state->granulepos;
+        }
+        else if(packet.granulepos != -1) {
+            state->granulepos = packet.granulepos;
+        }
+        lua_pop(L,1);
+    }
+
+    LUAOGG_PROBE4(stream_packetin,state->state.serialno,state->state.packetno,
+      packet.granulepos,packet.bytes);
+
+    if(ogg_stream_packetin(&state->state,&packet) != 0) {
+        lua_pushboolean(L,0);
+        return 1;
+    }
+    lua_pushboolean(L,1);
+
+    if(state->flush_policy) {
+        return 1 + luaogg_stream_policy_pageout(L,state,packet.granulepos);
+    }
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_packetout(lua_State *L) {
+    ogg_packet packet;
+    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    if(ogg_stream_packetout(state,&packet) == 1) {
+        LUAOGG_PROBE4(stream_packetout,state->serialno,packet.packetno,
+          packet.granulepos,packet.bytes);
+        luaogg_packet_to_table(L,&packet);
+    }
+    else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_packetpeek(lua_State *L) {
+    ogg_packet packet;
+    ogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    if(ogg_stream_packetpeek(state,&packet) == 1) {
+        luaogg_packet_to_table(L,&packet);
+    }
+    else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static ogg_uint32_t
+luaogg_read_le32(const unsigned char *p) {
+    return (ogg_uint32_t)p[0] | ((ogg_uint32_t)p[1] << 8) |
+      ((ogg_uint32_t)p[2] << 16) | ((ogg_uint32_t)p[3] << 24);
+}
+
+static ogg_int64_t
+luaogg_read_le64(const unsigned char *p) {
+    return (ogg_int64_t)((ogg_uint64_t)luaogg_read_le32(p) |
+      ((ogg_uint64_t)luaogg_read_le32(p + 4) << 32));
+}
+
+/* column order of the table returned by ogg.page_headers */
+static const char * const luaogg_page_header_fields[] = {
+    "offset",
+    "header_len",
+    "body_len",
+    "serialno",
+    "pageno",
+    "granulepos",
+    "flags",
+    "segments",
+    NULL,
+};
+
+static int
+luaogg_page_headers(lua_State *L) {
+    const unsigned char *buf = NULL;
+    const unsigned char *p = NULL;
+    size_t len = 0;
+    size_t pos;
+    size_t header_len;
+    size_t body_len;
+    lua_Integer offset;
+    lua_Integer count = 0;
+    int segments;
+    int i;
+    int t;
+
+    buf = (const unsigned char *)luaL_checklstring(L,1,&len);
+    offset = luaL_optinteger(L,2,1);
+    luaL_argcheck(L,offset >= 1 && (size_t)offset <= len + 1,2,"offset out of range");
+    pos = (size_t)offset - 1;
+
+    lua_newtable(L);
+    t = lua_gettop(L);
+    for(i=0;luaogg_page_header_fields[i] != NULL;i++) {
+        lua_newtable(L);
+    }
+
+    while(pos + 27 <= len) {
+        p = buf + pos;
+        if(memcmp(p,"OggS",4) != 0 || p[4] != 0) {
+            /* not on a page boundary, skip ahead to the next capture pattern */
+            p = memchr(buf + pos + 1,'O',len - pos - 1);
+            pos = p == NULL ? len : (size_t)(p - buf);
+            continue;
+        }
+
+        segments = p[26];
+        header_len = 27 + segments;
+        if(pos + header_len > len) {
+            break;
+        }
+        body_len = 0;
+        for(i=0;i<segments;i++) {
+            body_len += p[27 + i];
+        }
+        if(pos + header_len + body_len > len) {
+            break;
+        }
+
+        count++;
+        lua_pushinteger(L,(lua_Integer)pos + 1);
+        lua_rawseti(L,t + 1,count);
+        lua_pushinteger(L,(lua_Integer)header_len);
+        lua_rawseti(L,t + 2,count);
+        lua_pushinteger(L,(lua_Integer)body_len);
+        lua_rawseti(L,t + 3,count);
+        /* signed, the same as ogg_page_serialno and ogg_page_pageno in
+         * the page tables */
+        lua_pushinteger(L,(int)luaogg_read_le32(p + 14));
+        lua_rawseti(L,t + 4,count);
+        lua_pushinteger(L,(int)luaogg_read_le32(p + 18));
+        lua_rawseti(L,t + 5,count);
+#if LUA_VERSION_NUM >= 503
+        lua_pushinteger(L,(lua_Integer)luaogg_read_le64(p + 6));
+#else
+        luaogg_pushint64(L,luaogg_read_le64(p + 6));
+#endif
+        lua_rawseti(L,t + 6,count);
+        lua_pushinteger(L,p[5]);
+        lua_rawseti(L,t + 7,count);
+        lua_pushinteger(L,segments);
+        lua_rawseti(L,t + 8,count);
+
+        pos += header_len + body_len;
+    }
+
+    for(i=0;luaogg_page_header_fields[i] != NULL;i++) {
+        lua_pushvalue(L,t + 1 + i);
+        lua_setfield(L,t,luaogg_page_header_fields[i]);
+    }
+    lua_settop(L,t);
+    lua_pushinteger(L,count);
+    lua_setfield(L,t,"count");
+
+    lua_pushinteger(L,(lua_Integer)pos + 1);
+    return 2;
+}
+
+/* blobs from ogg_sync_serialize/ogg_stream_serialize start with one of
+ * these magic strings followed by a format version byte */
+#define LUAOGG_SERIALIZE_VERSION 1
+static const char luaogg_sync_magic[4]   = { 'L', 'O', 'S', 'y' };
+static const char luaogg_stream_magic[4] = { 'L', 'O', 'S', 't' };
+
+typedef struct luaogg_reader_s {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+} luaogg_reader;
+
+static void
+luaogg_buffer_le32(luaL_Buffer *b, ogg_uint32_t v) {
+    char t[4];
+    t[0] = (char)(v & 0xFF);
+    t[1] = (char)((v >> 8) & 0xFF);
+    t[2] = (char)((v >> 16) & 0xFF);
+    t[3] = (char)((v >> 24) & 0xFF);
+    luaL_addlstring(b,t,4);
+}
+
+static void
+luaogg_buffer_le64(luaL_Buffer *b, ogg_int64_t v) {
+    luaogg_buffer_le32(b,(ogg_uint32_t)((ogg_uint64_t)v & 0xFFFFFFFF));
+    luaogg_buffer_le32(b,(ogg_uint32_t)((ogg_uint64_t)v >> 32));
+}
+
+static const unsigned char *
+luaogg_reader_bytes(luaogg_reader *r, size_t len) {
+    const unsigned char *p = NULL;
+    if(r->len - r->pos < len) {
+        return NULL;
+    }
+    p = r->data + r->pos;
+    r->pos += len;
+    return p;
+}
+
+static int
+luaogg_reader_le32(luaogg_reader *r, ogg_uint32_t *v) {
+    const unsigned char *p = luaogg_reader_bytes(r,4);
+    if(p == NULL) {
+        return -1;
+    }
+    *v = luaogg_read_le32(p);
+    return 0;
+}
+
+static int
+luaogg_reader_le64(luaogg_reader *r, ogg_int64_t *v) {
+    const unsigned char *p = luaogg_reader_bytes(r,8);
+    if(p == NULL) {
+        return -1;
+    }
+    *v = luaogg_read_le64(p);
+    return 0;
+}
+
+/* copies everything except the header cache and codec attachments, which
+ * are Lua objects and can't follow a state into another Lua state */
+static void
+luaogg_sync_copy(lua_State *L, luaogg_sync_state *dst, luaogg_sync_state *src) {
+    ogg_sync_state *oy = &src->state;
+    long fill = oy->fill - oy->returned;
+
+    if(fill > 0) {
+        dst->state.data = malloc(fill);
+        if(dst->state.data == NULL) {
+            luaL_error(L,"out of memory");
+            return;
+        }
+        memcpy(dst->state.data,oy->data + oy->returned,fill);
+        dst->state.storage = fill;
+        dst->state.fill = fill;
+    }
+    if(oy->storage < 0) {
+        dst->state.storage = -1;
+    }
+    dst->state.unsynced = oy->unsynced;
+    dst->state.headerbytes = oy->headerbytes;
+    dst->state.bodybytes = oy->bodybytes;
+
+    if(src->serialno_count > 0) {
+        dst->serialnos = malloc(sizeof(ogg_uint32_t) * src->serialno_count);
+        if(dst->serialnos == NULL) {
+            luaL_error(L,"out of memory");
+            return;
+        }
+        memcpy(dst->serialnos,src->serialnos,sizeof(ogg_uint32_t) * src->serialno_count);
+        dst->serialno_count = src->serialno_count;
+    }
+    dst->serialno_deny = src->serialno_deny;
+    dst->filtering = src->filtering;
+    dst->pages = src->pages;
+    dst->bytes = src->bytes;
+    dst->skipped_pages = src->skipped_pages;
+    dst->skipped_bytes = src->skipped_bytes;
+    dst->trusted = src->trusted;
+    dst->trusted_sample = src->trusted_sample;
+    dst->trusted_count = src->trusted_count;
+}
+
+/* allocates the same buffers as ogg_stream_init, at least as large as
+ * needed to hold the given amount of data */
+static void
+luaogg_stream_alloc(lua_State *L, ogg_stream_state *os, long body, long lacing) {
+    os->body_storage = body > 16 * 1024 ? body : 16 * 1024;
+    os->lacing_storage = lacing > 1024 ? lacing : 1024;
+
+    os->body_data = malloc(os->body_storage);
+    os->lacing_vals = malloc(os->lacing_storage * sizeof(*os->lacing_vals));
+    os->granule_vals = malloc(os->lacing_storage * sizeof(*os->granule_vals));
+    if(os->body_data == NULL || os->lacing_vals == NULL || os->granule_vals == NULL) {
+        luaL_error(L,"out of memory");
+    }
+}
+
+/* already returned body data and lacing values are dropped from the copy,
+ * the same cleanup ogg_stream_pagein does */
+static void
+luaogg_stream_copy(lua_State *L, luaogg_stream_state *dst, luaogg_stream_state *src) {
+    ogg_stream_state *os = &src->state;
+    long body = os->body_fill - os->body_returned;
+    long lacing = os->lacing_fill - os->lacing_returned;
+
+    if(os->body_data != NULL) {
+        luaogg_stream_alloc(L,&dst->state,body,lacing);
+        memcpy(dst->state.body_data,os->body_data + os->body_returned,body);
+        memcpy(dst->state.lacing_vals,os->lacing_vals + os->lacing_returned,
+          lacing * sizeof(*os->lacing_vals));
+        memcpy(dst->state.granule_vals,os->granule_vals + os->lacing_returned,
+          lacing * sizeof(*os->granule_vals));
+        dst->state.body_fill = body;
+        dst->state.lacing_fill = lacing;
+        dst->state.lacing_packet = os->lacing_packet - os->lacing_returned;
+    }
+    memcpy(dst->state.header,os->header,sizeof(os->header));
+    dst->state.header_fill = os->header_fill;
+    dst->state.e_o_s = os->e_o_s;
+    dst->state.b_o_s = os->b_o_s;
+    dst->state.serialno = os->serialno;
+    dst->state.pageno = os->pageno;
+    dst->state.packetno = os->packetno;
+    dst->state.granulepos = os->granulepos;
+
+    dst->granulepos = src->granulepos;
+    dst->flush_policy = src->flush_policy;
+    dst->flush_bytes = src->flush_bytes;
+    dst->flush_packets = src->flush_packets;
+    dst->flush_granule_span = src->flush_granule_span;
+    dst->page_granulepos = src->page_granulepos;
+}
+
+static int
+luaogg_ogg_sync_clone(lua_State *L) {
+    luaogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    luaogg_sync_state *clone = NULL;
+
+    luaogg_ogg_sync_state(L);
+    clone = lua_touserdata(L,-1);
+    ogg_sync_clear(&clone->state);
+    luaogg_sync_copy(L,clone,state);
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_clone(lua_State *L) {
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    luaogg_stream_state *clone = NULL;
+
+    luaogg_ogg_stream_state(L);
+    clone = lua_touserdata(L,-1);
+    luaogg_stream_copy(L,clone,state);
+    return 1;
+}
+
+static int
+luaogg_ogg_sync_serialize(lua_State *L) {
+    luaogg_sync_state *state = luaL_checkudata(L,1,luaogg_sync_state_mt);
+    ogg_sync_state *oy = &state->state;
+    luaL_Buffer b;
+    size_t i;
+
+    luaL_buffinit(L,&b);
+    luaL_addlstring(&b,luaogg_sync_magic,4);
+    luaL_addchar(&b,LUAOGG_SERIALIZE_VERSION);
+
+    luaogg_buffer_le32(&b,(oy->storage < 0) | (state->filtering << 1) | (state->serialno_deny << 2) |
+      (state->trusted << 3));
+    luaogg_buffer_le32(&b,oy->unsynced);
+    luaogg_buffer_le32(&b,oy->headerbytes);
+    luaogg_buffer_le32(&b,oy->bodybytes);
+    luaogg_buffer_le64(&b,state->pages);
+    luaogg_buffer_le64(&b,state->bytes);
+    luaogg_buffer_le64(&b,state->skipped_pages);
+    luaogg_buffer_le64(&b,state->skipped_bytes);
+    luaogg_buffer_le64(&b,state->trusted_sample);
+    luaogg_buffer_le64(&b,state->trusted_count);
+
+    luaogg_buffer_le32(&b,(ogg_uint32_t)state->serialno_count);
+    for(i=0;i<state->serialno_count;i++) {
+        luaogg_buffer_le32(&b,state->serialnos[i]);
+    }
+
+    luaogg_buffer_le32(&b,oy->fill - oy->returned);
+    if(oy->fill > oy->returned) {
+        luaL_addlstring(&b,(const char *)oy->data + oy->returned,oy->fill - oy->returned);
+    }
+
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int
+luaogg_ogg_stream_serialize(lua_State *L) {
+    luaogg_stream_state *state = luaL_checkudata(L,1,luaogg_stream_state_mt);
+    ogg_stream_state *os = &state->state;
+    luaL_Buffer b;
+    long lacing = 0;
+    long i;
+
+    luaL_buffinit(L,&b);
+    luaL_addlstring(&b,luaogg_stream_magic,4);
+    luaL_addchar(&b,LUAOGG_SERIALIZE_VERSION);
+
+    luaogg_buffer_le32(&b,(os->body_data != NULL) | (os->e_o_s << 1) | (os->b_o_s << 2));
+    luaogg_buffer_le32(&b,(ogg_uint32_t)os->serialno);
+    luaogg_buffer_le64(&b,os->pageno);
+    luaogg_buffer_le64(&b,os->packetno);
+    luaogg_buffer_le64(&b,os->granulepos);
+
+    luaogg_buffer_le64(&b,state->granulepos);
+    luaogg_buffer_le32(&b,state->flush_policy);
+    luaogg_buffer_le64(&b,state->flush_bytes);
+    luaogg_buffer_le64(&b,state->flush_packets);
+    luaogg_buffer_le64(&b,state->flush_granule_span);
+    luaogg_buffer_le64(&b,state->page_granulepos);
+
+    luaogg_buffer_le32(&b,os->header_fill);
+    luaL_addlstring(&b,(const char *)os->header,os->header_fill);
+
+    if(os->body_data != NULL) {
+        lacing = os->lacing_fill - os->lacing_returned;
+
+        luaogg_buffer_le32(&b,os->body_fill - os->body_returned);
+        luaL_addlstring(&b,(const char *)os->body_data + os->body_returned,
+          os->body_fill - os->body_returned);
+
+        luaogg_buffer_le32(&b,lacing);
+        luaogg_buffer_le32(&b,os->lacing_packet - os->lacing_returned);
+        for(i=0;i<lacing;i++) {
+            luaogg_buffer_le32(&b,os->lacing_vals[os->lacing_returned + i]);
+            luaogg_buffer_le64(&b,os->granule_vals[os->lacing_returned + i]);
+        }
+    }
+
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int
+luaogg_sync_deserialize(lua_State *L, luaogg_reader *r) {
+    luaogg_sync_state *state = NULL;
+    ogg_sync_state *oy = NULL;
+    const unsigned char *p = NULL;
+    ogg_uint32_t flags, unsynced, headerbytes, bodybytes, count, fill, i;
+    ogg_int64_t pages, bytes, skipped_pages, skipped_bytes, trusted_sample, trusted_count;
+
+    if(luaogg_reader_le32(r,&flags) || luaogg_reader_le32(r,&unsynced) ||
+       luaogg_reader_le32(r,&headerbytes) || luaogg_reader_le32(r,&bodybytes) ||
+       luaogg_reader_le64(r,&pages) || luaogg_reader_le64(r,&bytes) ||
+       luaogg_reader_le64(r,&skipped_pages) || luaogg_reader_le64(r,&skipped_bytes) ||
+       luaogg_reader_le64(r,&trusted_sample) || luaogg_reader_le64(r,&trusted_count) ||
+       luaogg_reader_le32(r,&count) || count > (r->len - r->pos) / 4) {
+        return luaL_error(L,"invalid ogg_sync_state data");
+    }
+    if(headerbytes > 27 + 255 || bodybytes > 255 * 255) {
+        return luaL_error(L,"invalid ogg_sync_state data");
+    }
+
+    luaogg_ogg_sync_state(L);
+    state = lua_touserdata(L,-1);
+    oy = &state->state;
+
+    if(count > 0) {
+        state->serialnos = malloc(sizeof(ogg_uint32_t) * count);
+        if(state->serialnos == NULL) {
+            return luaL_error(L,"out of memory");
+        }
+        for(i=0;i<count;i++) {
+            luaogg_reader_le32(r,&state->serialnos[i]);
+        }
+        state->serialno_count = count;
+    }
+    state->filtering = (flags >> 1) & 0x01;
+    state->serialno_deny = (flags >> 2) & 0x01;
+    state->pages = (lua_Integer)pages;
+    state->bytes = (lua_Integer)bytes;
+    state->skipped_pages = (lua_Integer)skipped_pages;
+    state->skipped_bytes = (lua_Integer)skipped_bytes;
+    state->trusted = (flags >> 3) & 0x01;
+    state->trusted_sample = (lua_Integer)trusted_sample;
+    state->trusted_count = (lua_Integer)trusted_count;
+
+    if(luaogg_reader_le32(r,&fill) || (p = luaogg_reader_bytes(r,fill)) == NULL ||
+       fill > 0x7FFFFFFF) {
+        return luaL_error(L,"invalid ogg_sync_state data");
+    }
+    if(fill > 0) {
+        oy->data = malloc(fill);
+        if(oy->data == NULL) {
+            return luaL_error(L,"out of memory");
+        }
+        memcpy(oy->data,p,fill);
+        oy->storage = fill;
+        oy->fill = fill;
+    }
+    if(flags & 0x01) {
+        oy->storage = -1;
+    }
+    oy->unsynced = unsynced;
+    oy->headerbytes = headerbytes;
+    oy->bodybytes = bodybytes;
+
+    return 1;
+}
+
+static int
+luaogg_stream_deserialize(lua_State *L, luaogg_reader *r) {
+    luaogg_stream_state *state = NULL;
+    ogg_stream_state *os = NULL;
+    const unsigned char *header = NULL;
+    const unsigned char *body = NULL;
+    ogg_uint32_t flags, serialno, policy, header_fill;
+    ogg_uint32_t body_fill = 0;
+    ogg_uint32_t lacing = 0;
+    ogg_uint32_t lacing_packet = 0;
+    ogg_uint32_t val;
+    ogg_int64_t pageno, packetno, granulepos;
+    ogg_int64_t auto_granulepos, flush_bytes, flush_packets, flush_granule_span, page_granulepos;
+    ogg_int64_t total = 0;
+    ogg_uint32_t i;
+
+    if(luaogg_reader_le32(r,&flags) || luaogg_reader_le32(r,&serialno) ||
+       luaogg_reader_le64(r,&pageno) || luaogg_reader_le64(r,&packetno) ||
+       luaogg_reader_le64(r,&granulepos) || luaogg_reader_le64(r,&auto_granulepos) ||
+       luaogg_reader_le32(r,&policy) || luaogg_reader_le64(r,&flush_bytes) ||
+       luaogg_reader_le64(r,&flush_packets) || luaogg_reader_le64(r,&flush_granule_span) ||
+       luaogg_reader_le64(r,&page_granulepos) || luaogg_reader_le32(r,&header_fill) ||
+       header_fill > 282 || (header = luaogg_reader_bytes(r,header_fill)) == NULL) {
+        return luaL_error(L,"invalid ogg_stream_state data");
+    }
+
+    if(flags & 0x01) {
+        if(luaogg_reader_le32(r,&body_fill) || body_fill > 0x7FFFFFFF ||
+           (body = luaogg_reader_bytes(r,body_fill)) == NULL ||
+           luaogg_reader_le32(r,&lacing) || luaogg_reader_le32(r,&lacing_packet) ||
+           lacing_packet > lacing || lacing > (r->len - r->pos) / 12) {
+            return luaL_error(L,"invalid ogg_stream_state data");
+        }
+    }
+
+    luaogg_ogg_stream_state(L);
+    state = lua_touserdata(L,-1);
+    os = &state->state;
+
+    if(flags & 0x01) {
+        luaogg_stream_alloc(L,os,body_fill,lacing);
+        memcpy(os->body_data,body,body_fill);
+        for(i=0;i<lacing;i++) {
+            luaogg_reader_le32(r,&val);
+            luaogg_reader_le64(r,&os->granule_vals[i]);
+            os->lacing_vals[i] = (int)val;
+            total += val & 0xFF;
+        }
+        /* the lacing values index into the body, so they have to agree */
+        if(total > body_fill) {
+            return luaL_error(L,"invalid ogg_stream_state data");
+        }
+        os->body_fill = body_fill;
+        os->lacing_fill = lacing;
+        os->lacing_packet = lacing_packet;
+    }
+
+    memcpy(os->header,header,header_fill);
+    os->header_fill = header_fill;
+    os->e_o_s = (flags >> 1) & 0x01;
+    os->b_o_s = (flags >> 2) & 0x01;
+    os->serialno = (int)serialno;
+    os->pageno = (long)pageno;
+    os->packetno = packetno;
+    os->granulepos = granulepos;
+
+    state->granulepos = auto_granulepos;
+    state->flush_policy = policy != 0;
+    state->flush_bytes = (long)flush_bytes;
+    state->flush_packets = (long)flush_packets;
+    state->flush_granule_span = flush_granule_span;
+    state->page_granulepos = page_granulepos;
+
+    return 1;
+}
+
+static int
+luaogg_deserialize(lua_State *L) {
+    luaogg_reader r;
+    const unsigned char *magic = NULL;
+
+    r.data = (const unsigned char *)luaL_checklstring(L,1,&r.len);
+    r.pos = 0;
+
+    magic = luaogg_reader_bytes(&r,5);
+    if(magic == NULL || magic[4] != LUAOGG_SERIALIZE_VERSION) {
+        return luaL_error(L,"unknown serialized data");
+    }
+    if(memcmp(magic,luaogg_sync_magic,4) == 0) {
+        return luaogg_sync_deserialize(L,&r);
+    }
+    if(memcmp(magic,luaogg_stream_magic,4) == 0) {
+        return luaogg_stream_deserialize(L,&r);
+    }
+    return luaL_error(L,"unknown serialized data");
+}
+
+typedef struct luaogg_keypoint_s {
+    ogg_int64_t offset;
+    ogg_int64_t time;
+} luaogg_keypoint;
+
+/* keypoints of one track, from a Skeleton 4.0 index packet */
+typedef struct luaogg_skeleton_index_s {
+    ogg_uint32_t serialno;
+    ogg_int64_t denominator;
+    size_t count;
+    luaogg_keypoint *keypoints;
+} luaogg_skeleton_index;
+
+typedef struct luaogg_skeleton_s {
+    int version_major;
+    int version_minor;
+    ogg_int64_t segment_length;
+    ogg_int64_t content_offset;
+    size_t count;
+    luaogg_skeleton_index *indexes;
+} luaogg_skeleton;
+
+static int
+luaogg_skeleton_new(lua_State *L) {
+    luaogg_skeleton *skeleton = lua_newuserdata(L,sizeof(luaogg_skeleton));
+    if(skeleton == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    memset(skeleton,0,sizeof(luaogg_skeleton));
+
+    luaL_setmetatable(L,luaogg_skeleton_mt);
+
+    return 1;
+}
+
+static luaogg_skeleton_index *
+luaogg_skeleton_find(luaogg_skeleton *skeleton, ogg_uint32_t serialno) {
+    size_t i;
+    for(i=0;i<skeleton->count;i++) {
+        if(skeleton->indexes[i].serialno == serialno) {
+            return &skeleton->indexes[i];
+        }
+    }
+    return NULL;
+}
+
+/* keypoint offsets and times are stored as deltas from the previous
+ * keypoint, each as a variable-length integer: 7 bits per byte, least
+ * significant group first, with the high bit set on the last byte */
+static const unsigned char *
+luaogg_skeleton_varint(const unsigned char *p, const unsigned char *end, ogg_int64_t *value) {
+    ogg_uint64_t v = 0;
+    int shift = 0;
+
+    while(p < end && shift < 63) {
+        v |= (ogg_uint64_t)(*p & 0x7F) << shift;
+        shift += 7;
+        if(*p++ & 0x80) {
+            *value = (ogg_int64_t)v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static int
+luaogg_skeleton_index_packet(lua_State *L, luaogg_skeleton *skeleton, const unsigned char *data, size_t len) {
+    luaogg_skeleton_index *index = NULL;
+    luaogg_keypoint *keypoints = NULL;
+    const unsigned char *p = NULL;
+    const unsigned char *end = data + len;
+    ogg_int64_t count;
+    ogg_int64_t denominator;
+    ogg_int64_t offset = 0;
+    ogg_int64_t time = 0;
+    ogg_int64_t delta;
+    ogg_int64_t i;
+
+    if(len < 42) {
+        return 0;
+    }
+    count = luaogg_read_le64(data + 10);
+    denominator = luaogg_read_le64(data + 18);
+
+    /* every keypoint takes at least two bytes */
+    if(count < 0 || (ogg_uint64_t)count > (len - 42) / 2 || denominator <= 0) {
+        return 0;
+    }
+
+    if(count > 0) {
+        keypoints = malloc(sizeof(luaogg_keypoint) * (size_t)count);
+        if(keypoints == NULL) {
+            return luaL_error(L,"out of memory");
+        }
+    }
+
+    p = data + 42;
+    for(i=0;i<count;i++) {
+        if((p = luaogg_skeleton_varint(p,end,&delta)) == NULL) {
+            break;
+        }
+        offset += delta;
+        if((p = luaogg_skeleton_varint(p,end,&delta)) == NULL) {
+            break;
+        }
+        time += delta;
+        keypoints[i].offset = offset;
+        keypoints[i].time = time;
+    }
+    if(i < count) {
+        free(keypoints);
+        return 0;
+    }
+
+    index = luaogg_skeleton_find(skeleton,luaogg_read_le32(data + 6));
+    if(index == NULL) {
+        index = realloc(skeleton->indexes,sizeof(luaogg_skeleton_index) * (skeleton->count + 1));
+        if(index == NULL) {
+            free(keypoints);
+            return luaL_error(L,"out of memory");
+        }
+        skeleton->indexes = index;
+        index = &skeleton->indexes[skeleton->count++];
+        index->keypoints = NULL;
+    }
+    free(index->keypoints);
+    index->serialno = luaogg_read_le32(data + 6);
+    index->denominator = denominator;
+    index->count = (size_t)count;
+    index->keypoints = keypoints;
+    return 1;
+}
+
+/* parses a packet from the Skeleton track. returns the type of packet
+ * ("fishead", "fisbone" or "index"), or nil if it wasn't understood */
+static int
+luaogg_skeleton_packetin(lua_State *L) {
+    luaogg_skeleton *skeleton = luaL_checkudata(L,1,luaogg_skeleton_mt);
+    const unsigned char *data = NULL;
+    size_t len = 0;
+
+    data = luaogg_checkpacketdata(L,2,&len);
+
+    if(len >= 64 && memcmp(data,"fishead\0",8) == 0) {
+        skeleton->version_major = data[8] | (data[9] << 8);
+        skeleton->version_minor = data[10] | (data[11] << 8);
+        if(skeleton->version_major >= 4 && len >= 80) {
+            skeleton->segment_length = luaogg_read_le64(data + 64);
+            skeleton->content_offset = luaogg_read_le64(data + 72);
+        }
+        lua_pushliteral(L,"fishead");
+        return 1;
+    }
+
+    if(len >= 8 && memcmp(data,"fisbone\0",8) == 0) {
+        lua_pushliteral(L,"fisbone");
+        return 1;
+    }
+
+    if(len >= 6 && memcmp(data,"index\0",6) == 0) {
+        if(luaogg_skeleton_index_packet(L,skeleton,data,len)) {
+            lua_pushliteral(L,"index");
+            return 1;
+        }
+    }
+
+    lua_pushnil(L);
+    return 1;
+}
+
+/* finds the last keypoint at or before the target time */
+static luaogg_keypoint *
+luaogg_skeleton_keypoint(luaogg_skeleton_index *index, lua_Number seconds) {
+    ogg_int64_t target = (ogg_int64_t)(seconds * (lua_Number)index->denominator);
+    size_t lo = 0;
+    size_t hi = index->count;
+    size_t mid;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(index->keypoints[mid].time <= target) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo == 0 ? NULL : &index->keypoints[lo - 1];
+}
+
+/* returns the byte offset to start reading from to seek to the given time
+ * in a track, and the keypoint's time. with no serialno, every track is
+ * considered and the earliest offset wins, so all tracks can be decoded
+ * from there */
+static int
+luaogg_skeleton_seek_offset(lua_State *L) {
+    luaogg_skeleton *skeleton = luaL_checkudata(L,1,luaogg_skeleton_mt);
+    lua_Number seconds = luaL_checknumber(L,3);
+    luaogg_skeleton_index *index = NULL;
+    luaogg_keypoint *keypoint = NULL;
+    luaogg_keypoint *best = NULL;
+    luaogg_skeleton_index *best_index = NULL;
+    size_t i;
+
+    if(!lua_isnoneornil(L,2)) {
+        index = luaogg_skeleton_find(skeleton,(ogg_uint32_t)luaL_checkinteger(L,2));
+        if(index == NULL) {
+            lua_pushnil(L);
+            return 1;
+        }
+        best = luaogg_skeleton_keypoint(index,seconds);
+        best_index = index;
+    }
+    else {
+        for(i=0;i<skeleton->count;i++) {
+            keypoint = luaogg_skeleton_keypoint(&skeleton->indexes[i],seconds);
+            if(keypoint != NULL && (best == NULL || keypoint->offset < best->offset)) {
+                best = keypoint;
+                best_index = &skeleton->indexes[i];
+            }
+        }
+    }
+
+    if(best == NULL) {
+        /* before the first keypoint, start at the first data page */
+        if(skeleton->content_offset <= 0) {
+            lua_pushnil(L);
+            return 1;
+        }
+        lua_pushinteger(L,(lua_Integer)skeleton->content_offset);
+        lua_pushnumber(L,0);
+        return 2;
+    }
+
+    lua_pushinteger(L,(lua_Integer)best->offset);
+    lua_pushnumber(L,(lua_Number)best->time / (lua_Number)best_index->denominator);
+    return 2;
+}
+
+static int
+luaogg_skeleton_keypoints(lua_State *L) {
+    luaogg_skeleton *skeleton = luaL_checkudata(L,1,luaogg_skeleton_mt);
+    luaogg_skeleton_index *index = NULL;
+
+    index = luaogg_skeleton_find(skeleton,(ogg_uint32_t)luaL_checkinteger(L,2));
+    lua_pushinteger(L,index == NULL ? 0 : (lua_Integer)index->count);
+    return 1;
+}
+
+static int
+luaogg_skeleton_info(lua_State *L) {
+    luaogg_skeleton *skeleton = luaL_checkudata(L,1,luaogg_skeleton_mt);
+    size_t i;
+
+    lua_newtable(L);
+    lua_pushinteger(L,skeleton->version_major);
+    lua_setfield(L,-2,"version_major");
+    lua_pushinteger(L,skeleton->version_minor);
+    lua_setfield(L,-2,"version_minor");
+    lua_pushinteger(L,(lua_Integer)skeleton->segment_length);
+    lua_setfield(L,-2,"segment_length");
+    lua_pushinteger(L,(lua_Integer)skeleton->content_offset);
+    lua_setfield(L,-2,"content_offset");
+
+    lua_createtable(L,(int)skeleton->count,0);
+    for(i=0;i<skeleton->count;i++) {
+        lua_pushinteger(L,skeleton->indexes[i].serialno);
+        lua_rawseti(L,-2,i+1);
+    }
+    lua_setfield(L,-2,"indexes");
+    return 1;
+}
+
+static int
+luaogg_skeleton__gc(lua_State *L) {
+    luaogg_skeleton *skeleton = luaL_checkudata(L,1,luaogg_skeleton_mt);
+    size_t i;
+
+    for(i=0;i<skeleton->count;i++) {
+        free(skeleton->indexes[i].keypoints);
+    }
+    free(skeleton->indexes);
+    skeleton->indexes = NULL;
+    skeleton->count = 0;
+    return 0;
+}
+
+typedef struct luaogg_stream_pool_s {
+    /* most idle states kept */
+    lua_Integer size;
+    /* registry ref to an array of idle stream userdata */
+    int ref;
+    lua_Integer count;
+    lua_Integer hits;
+    lua_Integer misses;
+} luaogg_stream_pool;
+
+static int
+luaogg_stream_pool_new(lua_State *L) {
+    lua_Integer size = luaL_checkinteger(L,1);
+    luaogg_stream_pool *pool = NULL;
+
+    luaL_argcheck(L,size >= 0,1,"size must not be negative");
+
+    pool = lua_newuserdata(L,sizeof(luaogg_stream_pool));
+    if(pool == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    memset(pool,0,sizeof(luaogg_stream_pool));
+    pool->size = size;
+
+    lua_createtable(L,(int)size,0);
+    pool->ref = luaL_ref(L,LUA_REGISTRYINDEX);
+
+    luaL_setmetatable(L,luaogg_stream_pool_mt);
+
+    return 1;
+}
+
+/* hands out an initialized stream state, reusing an idle one (and its
+ * buffers) when there is one */
+static int
+luaogg_stream_pool_acquire(lua_State *L) {
+    luaogg_stream_pool *pool = luaL_checkudata(L,1,luaogg_stream_pool_mt);
+    lua_Integer serialno = luaL_checkinteger(L,2);
+    luaogg_stream_state *state = NULL;
+
+    if(pool->count > 0) {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,pool->ref);
+        lua_rawgeti(L,-1,(int)pool->count);
+        lua_pushnil(L);
+        lua_rawseti(L,-3,(int)pool->count);
+        lua_remove(L,-2);
+        pool->count--;
+        pool->hits++;
+
+        state = lua_touserdata(L,-1);
+        state->pooled = 0;
+        state->granulepos = 0;
+        state->page_granulepos = -1;
+        if(ogg_stream_reset_serialno(&state->state,(int)serialno) == 0) {
+            return 1;
+        }
+        /* cleared before it was released, start over */
+        if(ogg_stream_init(&state->state,(int)serialno) != 0) {
+            return luaL_error(L,"ogg_stream_init error");
+        }
+        return 1;
+    }
+
+    pool->misses++;
+    luaogg_ogg_stream_state(L);
+    state = lua_touserdata(L,-1);
+    if(ogg_stream_init(&state->state,(int)serialno) != 0) {
+        return luaL_error(L,"ogg_stream_init error");
+    }
+    return 1;
+}
+
+/* takes a stream state back. attachments and the flush policy are
+ * dropped; the buffers are kept for the next acquire. returns false if
+ * the pool is full, in which case the state's buffers are freed */
+static int
+luaogg_stream_pool_release(lua_State *L) {
+    luaogg_stream_pool *pool = luaL_checkudata(L,1,luaogg_stream_pool_mt);
+    luaogg_stream_state *state = luaL_checkudata(L,2,luaogg_stream_state_mt);
+
+    if(state->pooled) {
+        return luaL_argerror(L,2,"stream state was already released");
+    }
+
+    luaL_unref(L,LUA_REGISTRYINDEX,state->cache_ref);
+    state->cache_ref = LUA_NOREF;
+    state->cache = NULL;
+    luaL_unref(L,LUA_REGISTRYINDEX,state->codec_ref);
+    state->codec_ref = LUA_NOREF;
+    state->codec = NULL;
+    state->flush_policy = 0;
+    state->flush_bytes = 0;
+    state->flush_packets = 0;
+    state->flush_granule_span = 0;
+
+    if(pool->count >= pool->size || ogg_stream_check(&state->state) != 0) {
+        ogg_stream_clear(&state->state);
+        lua_pushboolean(L,0);
+        return 1;
+    }
+
+    lua_rawgeti(L,LUA_REGISTRYINDEX,pool->ref);
+    lua_pushvalue(L,2);
+    lua_rawseti(L,-2,(int)++pool->count);
+    lua_pop(L,1);
+    state->pooled = 1;
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaogg_stream_pool_stats(lua_State *L) {
+    luaogg_stream_pool *pool = luaL_checkudata(L,1,luaogg_stream_pool_mt);
+    luaogg_stream_state *state = NULL;
+    lua_Integer requests = pool->hits + pool->misses;
+    lua_Integer bytes = 0;
+    lua_Integer i;
+
+    lua_rawgeti(L,LUA_REGISTRYINDEX,pool->ref);
+    for(i=1;i<=pool->count;i++) {
+        lua_rawgeti(L,-1,(int)i);
+        state = lua_touserdata(L,-1);
+        bytes += state->state.body_storage + state->state.lacing_storage *
+          (lua_Integer)(sizeof(*state->state.lacing_vals) + sizeof(*state->state.granule_vals));
+        lua_pop(L,1);
+    }
+    lua_pop(L,1);
+
+    lua_newtable(L);
+    lua_pushinteger(L,pool->size);
+    lua_setfield(L,-2,"size");
+    lua_pushinteger(L,pool->count);
+    lua_setfield(L,-2,"pooled");
+    lua_pushinteger(L,bytes);
+    lua_setfield(L,-2,"pooled_bytes");
+    lua_pushinteger(L,pool->hits);
+    lua_setfield(L,-2,"hits");
+    lua_pushinteger(L,pool->misses);
+    lua_setfield(L,-2,"misses");
+    lua_pushnumber(L,requests == 0 ? 0 : (lua_Number)pool->hits / (lua_Number)requests);
+    lua_setfield(L,-2,"hit_rate");
+    return 1;
+}
+
+/* drops every idle state, they're freed once collected */
+static int
+luaogg_stream_pool_clear(lua_State *L) {
+    luaogg_stream_pool *pool = luaL_checkudata(L,1,luaogg_stream_pool_mt);
+    luaogg_stream_state *state = NULL;
+
+    lua_rawgeti(L,LUA_REGISTRYINDEX,pool->ref);
+    while(pool->count > 0) {
+        lua_rawgeti(L,-1,(int)pool->count);
+        state = lua_touserdata(L,-1);
+        ogg_stream_clear(&state->state);
+        lua_pop(L,1);
+        lua_pushnil(L);
+        lua_rawseti(L,-2,(int)pool->count--);
+    }
+    lua_pop(L,1);
+    return 0;
+}
+
+static int
+luaogg_stream_pool__gc(lua_State *L) {
+    luaogg_stream_pool *pool = luaL_checkudata(L,1,luaogg_stream_pool_mt);
+    luaL_unref(L,LUA_REGISTRYINDEX,pool->ref);
+    pool->ref = LUA_NOREF;
+    pool->count = 0;
+    return 0;
+}
+
+typedef struct luaogg_cut_state_s {
+    lua_State *L;
+    FILE *in;
+    FILE *out;
+    ogg_sync_state *sync;
+    ogg_sync_state *run;
+    ogg_uint32_t serialno;
+    int have_serialno;
+    ogg_int64_t start;
+    ogg_int64_t end;
+    ogg_int64_t granulepos;
+    long pageno;
+    int header_phase;
+    int trim;
+    int eos;
+    int bisected;
+    long seen;
+    ogg_page pending;
+    int have_pending;
+    lua_Integer pages;
+    lua_Integer bytes;
+    unsigned char header[27 + 255];
+    unsigned char pending_data[LUAOGG_MAX_PAGE];
+    /* finished pages waiting to be written, LUAOGG_MAX_PAGE fits in it */
+    size_t out_len;
+    unsigned char out_data[LUAOGG_CUT_CHUNK];
+} luaogg_cut_state;
+
+static FILE *
+luaogg_tofile(lua_State *L, int idx) {
+#if LUA_VERSION_NUM >= 502
+    luaL_Stream *s = luaL_checkudata(L,idx,LUA_FILEHANDLE);
+    if(s->closef == NULL) {
+        luaL_error(L,"attempt to use a closed file");
+        return NULL;
+    }
+    return s->f;
+#else
+    FILE **f = luaL_checkudata(L,idx,LUA_FILEHANDLE);
+    if(*f == NULL) {
+        luaL_error(L,"attempt to use a closed file");
+        return NULL;
+    }
+    return *f;
+#endif
+}
+
+/* reads the next page belonging to the selected logical stream, pages from
+ * other logical streams are discarded without leaving C. returns 0 at the
+ * end of input */
+static int
+luaogg_cut_pageout(luaogg_cut_state *c, ogg_page *page) {
+    char *buffer = NULL;
+    const char *data = NULL;
+    size_t len = 0;
+    int r;
+
+    for(;;) {
+        r = ogg_sync_pageout(c->sync,page);
+        if(r > 0) {
+            if(!c->have_serialno && ogg_page_bos(page)) {
+                c->serialno = (ogg_uint32_t)ogg_page_serialno(page);
+                c->have_serialno = 1;
+            }
+            if(c->have_serialno && (ogg_uint32_t)ogg_page_serialno(page) == c->serialno) {
+                if(c->seen++ > 0 && ogg_page_bos(page)) {
+                    /* serial number reused by a new chained link */
+                    return 0;
+                }
+                return 1;
+            }
+            continue;
+        }
+        if(r < 0) {
+            continue;
+        }
+
+        if(c->in != NULL) {
+            buffer = ogg_sync_buffer(c->sync,LUAOGG_CUT_CHUNK);
+            if(buffer == NULL) {
+                return luaL_error(c->L,"ogg_sync_buffer error");
+            }
+            len = fread(buffer,1,LUAOGG_CUT_CHUNK,c->in);
+            if(len == 0) {
+                if(ferror(c->in)) {
+                    return luaL_error(c->L,"read error");
+                }
+                return 0;
+            }
+        }
+        else {
+            lua_pushvalue(c->L,1);
+            lua_call(c->L,0,1);
+            data = lua_tolstring(c->L,-1,&len);
+            if(data == NULL || len == 0) {
+                lua_pop(c->L,1);
+                return 0;
+            }
+            buffer = ogg_sync_buffer(c->sync,len);
+            if(buffer == NULL) {
+                return luaL_error(c->L,"ogg_sync_buffer error");
+            }
+            memcpy(buffer,data,len);
+            lua_pop(c->L,1);
+        }
+        ogg_sync_wrote(c->sync,len);
+    }
+}
+
+/* finds the first page of the selected logical stream that finishes a
+ * packet, reading from offset pos up to limit. returns its granulepos, or
+ * -1 if there's no such page before limit or a new link starts */
+static ogg_int64_t
+luaogg_cut_probe(luaogg_cut_state *c, long pos, long limit) {
+    ogg_page page;
+    ogg_int64_t granulepos;
+    char *buffer = NULL;
+    size_t len;
+    long r;
+
+    ogg_sync_reset(c->run);
+    if(fseek(c->in,pos,SEEK_SET) != 0) {
+        return -1;
+    }
+
+    while(pos < limit) {
+        r = ogg_sync_pageseek(c->run,&page);
+        if(r < 0) {
+            pos -= r;
+            continue;
+        }
+        if(r > 0) {
+            pos += r;
+            if((ogg_uint32_t)ogg_page_serialno(&page) != c->serialno) {
+                continue;
+            }
+            if(ogg_page_bos(&page)) {
+                return -1;
+            }
+            granulepos = ogg_page_granulepos(&page);
+            if(granulepos != -1) {
+                return granulepos;
+            }
+            continue;
+        }
+
+        buffer = ogg_sync_buffer(c->run,LUAOGG_CUT_CHUNK);
+        if(buffer == NULL) {
+            luaL_error(c->L,"ogg_sync_buffer error");
+            return -1;
+        }
+        len = fread(buffer,1,LUAOGG_CUT_CHUNK,c->in);
+        if(len == 0) {
+            return -1;
+        }
+        ogg_sync_wrote(c->run,len);
+    }
+    return -1;
+}
+
+/* called on the first data page at or before the start of the range,
+ * which starts at offset pos. if the input is a seekable file, searches on
+ * granulepos for a later page that's still at or before the start, and
+ * moves the input there so the scan skips the pages in between. the
+ * search gallops forward first, so a range near the current position
+ * costs about as much as the linear scan */
+static void
+luaogg_cut_bisect(luaogg_cut_state *c, long pos) {
+    ogg_int64_t granulepos;
+    long lo = pos;
+    long hi;
+    long mid;
+    long step = LUAOGG_CUT_CHUNK;
+    long size;
+
+    if(c->in == NULL || fseek(c->in,0,SEEK_END) != 0 || (size = ftell(c->in)) < 0) {
+        return;
+    }
+
+    hi = size;
+    while(step < size - lo) {
+        granulepos = luaogg_cut_probe(c,lo + step,size);
+        if(granulepos == -1 || granulepos > c->start) {
+            hi = lo + step;
+            break;
+        }
+        lo += step;
+        step *= 2;
+    }
+
+    while(hi - lo > LUAOGG_CUT_CHUNK) {
+        mid = lo + (hi - lo) / 2;
+        granulepos = luaogg_cut_probe(c,mid,hi);
+        if(granulepos != -1 && granulepos <= c->start) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    ogg_sync_reset(c->run);
+    if(fseek(c->in,lo,SEEK_SET) != 0) {
+        luaL_error(c->L,"seek error");
+        return;
+    }
+    ogg_sync_reset(c->sync);
+}
+
+static void
+luaogg_cut_flush(luaogg_cut_state *c) {
+    if(c->out_len > 0 && fwrite(c->out_data,1,c->out_len,c->out) != c->out_len) {
+        luaL_error(c->L,"write error");
+        return;
+    }
+    c->out_len = 0;
+}
+
+/* renumbers the page, recomputes the CRC and adds it to the output
+ * buffer, which is written out with a single fwrite once full */
+static void
+luaogg_cut_write(luaogg_cut_state *c, ogg_page *page) {
+    ogg_int64_t granulepos = ogg_page_granulepos(page);
+    size_t len = page->header_len + page->body_len;
+
+    page->header[18] = (unsigned char)(c->pageno & 0xFF);
+    page->header[19] = (unsigned char)((c->pageno >> 8) & 0xFF);
+    page->header[20] = (unsigned char)((c->pageno >> 16) & 0xFF);
+    page->header[21] = (unsigned char)((c->pageno >> 24) & 0xFF);
+    ogg_page_checksum_set(page);
+
+    if(c->out_len + len > sizeof(c->out_data)) {
+        luaogg_cut_flush(c);
+    }
+    memcpy(c->out_data + c->out_len,page->header,page->header_len);
+    memcpy(c->out_data + c->out_len + page->header_len,page->body,page->body_len);
+    c->out_len += len;
+
+    if(granulepos != -1) {
+        c->granulepos = granulepos;
+    }
+    c->eos = ogg_page_eos(page);
+    c->pageno++;
+    c->pages++;
+    c->bytes += len;
+}
+
+static void
+luaogg_cut_set_granulepos(ogg_page *page, ogg_int64_t granulepos) {
+    int i;
+    for(i=0;i<8;i++) {
+        page->header[6+i] = (unsigned char)(granulepos & 0xFF);
+        granulepos >>= 8;
+    }
+}
+
+/* drops the tail of a packet continued from an earlier page, which is not
+ * part of the output. returns 0 if nothing is left on the page */
+static int
+luaogg_cut_trim_head(luaogg_cut_state *c, ogg_page *page) {
+    int segments = page->header[26];
+    int i = 0;
+    int done = 0;
+    long skip = 0;
+
+    if(!ogg_page_continued(page)) {
+        return 1;
+    }
+
+    while(i < segments && !done) {
+        skip += page->header[27 + i];
+        done = page->header[27 + i] < 255;
+        i++;
+    }
+    if(i == segments) {
+        return 0;
+    }
+
+    memcpy(c->header,page->header,27);
+    memcpy(c->header + 27,page->header + 27 + i,segments - i);
+    c->header[5] &= ~0x01;
+    c->header[26] = (unsigned char)(segments - i);
+    page->header = c->header;
+    page->header_len = 27 + segments - i;
+    page->body += skip;
+    page->body_len -= skip;
+
+    /* if the only packet that finished here was the one we dropped, no
+     * packet finishes on this page anymore */
+    for(done = 0, segments -= i, i = 0; i < segments; i++) {
+        done |= page->header[27 + i] < 255;
+    }
+    if(!done) {
+        luaogg_cut_set_granulepos(page,-1);
+    }
+    return 1;
+}
+
+/* adds a data page to the output. the most recent page is held back so the
+ * last one can be closed off with the EOS flag */
+static void
+luaogg_cut_accept(luaogg_cut_state *c, ogg_page *page) {
+    if(c->trim) {
+        if(!luaogg_cut_trim_head(c,page)) {
+            return;
+        }
+        c->trim = 0;
+    }
+
+    if(c->have_pending) {
+        luaogg_cut_write(c,&c->pending);
+    }
+
+    memcpy(c->pending_data,page->header,page->header_len);
+    memcpy(c->pending_data + page->header_len,page->body,page->body_len);
+    c->pending.header = c->pending_data;
+    c->pending.header_len = page->header_len;
+    c->pending.body = c->pending_data + page->header_len;
+    c->pending.body_len = page->body_len;
+    c->have_pending = 1;
+}
+
+/* writes out any pages held in the run buffer */
+static void
+luaogg_cut_drain(luaogg_cut_state *c) {
+    ogg_page page;
+    while(ogg_sync_pageout(c->run,&page) > 0) {
+        if(c->header_phase) {
+            luaogg_cut_write(c,&page);
+        }
+        else {
+            luaogg_cut_accept(c,&page);
+        }
+    }
+    ogg_sync_reset(c->run);
+}
+
+static void
+luaogg_cut_defer(luaogg_cut_state *c, ogg_page *page) {
+    char *buffer = ogg_sync_buffer(c->run,page->header_len + page->body_len);
+    if(buffer == NULL) {
+        luaL_error(c->L,"ogg_sync_buffer error");
+        return;
+    }
+    memcpy(buffer,page->header,page->header_len);
+    memcpy(buffer + page->header_len,page->body,page->body_len);
+    ogg_sync_wrote(c->run,page->header_len + page->body_len);
+}
+
+/* closes the output: drops a trailing unfinished packet, trims the final
+ * granulepos to the end of the range and sets the EOS flag */
+static void
+luaogg_cut_finish(luaogg_cut_state *c) {
+    ogg_page *page = &c->pending;
+    int segments;
+    int n;
+
+    if(!c->have_pending) {
+        if(c->pages == 0 || c->eos) {
+            return;
+        }
+        memcpy(c->header,"OggS",4);
+        memset(c->header + 4,0,23);
+        c->header[5] = 0x04;
+        c->header[14] = (unsigned char)(c->serialno & 0xFF);
+        c->header[15] = (unsigned char)((c->serialno >> 8) & 0xFF);
+        c->header[16] = (unsigned char)((c->serialno >> 16) & 0xFF);
+        c->header[17] = (unsigned char)((c->serialno >> 24) & 0xFF);
+        page->header = c->header;
+        page->header_len = 27;
+        page->body = c->header;
+        page->body_len = 0;
+        luaogg_cut_set_granulepos(page,c->granulepos);
+        luaogg_cut_write(c,page);
+        return;
+    }
+
+    segments = page->header[26];
+    n = segments;
+    while(n > 0 && page->header[27 + n - 1] == 255) {
+        n--;
+    }
+    page->header[26] = (unsigned char)n;
+    page->header_len = 27 + n;
+    page->body_len -= 255 * (segments - n);
+
+    if(n == 0) {
+        luaogg_cut_set_granulepos(page,c->granulepos);
+    }
+    else if(c->end >= 0 && ogg_page_granulepos(page) > c->end) {
+        luaogg_cut_set_granulepos(page,c->end);
+    }
+    page->header[5] |= 0x04;
+
+    luaogg_cut_write(c,page);
+    c->have_pending = 0;
+}
+
+static int
+luaogg_cut(lua_State *L) {
+    luaogg_cut_state *c = NULL;
+    ogg_page page;
+    ogg_int64_t granulepos;
+    long pos;
+    int started = 0;
+
+    lua_settop(L,5);
+
+    c = lua_newuserdata(L,sizeof(luaogg_cut_state));
+    if(c == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    memset(c,0,sizeof(luaogg_cut_state));
+    c->L = L;
+    c->in = lua_isfunction(L,1) ? NULL : luaogg_tofile(L,1);
+    c->out = luaogg_tofile(L,2);
+
+    if(!lua_isnil(L,3)) {
+        c->serialno = (ogg_uint32_t)luaL_checkinteger(L,3);
+        c->have_serialno = 1;
+    }
+    c->start = lua_isnil(L,4) ? 0 : luaogg_toint64(L,4);
+    c->end = lua_isnil(L,5) ? -1 : luaogg_toint64(L,5);
+
+    luaL_argcheck(L,c->start >= 0,4,"start_granule must not be negative");
+    luaL_argcheck(L,c->end < 0 || c->end >= c->start,5,"end_granule must not be before start_granule");
+
+    /* both sync states are userdata so they're freed even if a read, write
+     * or the reader function raises an error */
+    luaogg_ogg_sync_state(L);
+    c->sync = lua_touserdata(L,-1);
+    luaogg_ogg_sync_state(L);
+    c->run = lua_touserdata(L,-1);
+
+    c->header_phase = 1;
+
+    while(luaogg_cut_pageout(c,&page)) {
+        granulepos = ogg_page_granulepos(&page);
+
+        /* pages where no packet finishes are held back until we know if
+         * they belong to the headers, to data before the range, or to the
+         * first packet of the range */
+        if(granulepos == -1 && !started) {
+            luaogg_cut_defer(c,&page);
+            continue;
+        }
+
+        if(c->header_phase) {
+            if(granulepos == 0) {
+                luaogg_cut_drain(c);
+                luaogg_cut_write(c,&page);
+                if(c->eos) {
+                    break;
+                }
+                continue;
+            }
+            c->header_phase = 0;
+            c->trim = 1;
+        }
+
+        if(!started) {
+            if(granulepos <= c->start) {
+                ogg_sync_reset(c->run);
+                if(!c->bisected && c->in != NULL) {
+                    c->bisected = 1;
+                    pos = ftell(c->in);
+                    if(pos >= 0) {
+                        pos -= c->sync->fill - c->sync->returned;
+                        luaogg_cut_bisect(c,pos - page.header_len - page.body_len);
+                    }
+                }
+                continue;
+            }
+            started = 1;
+            luaogg_cut_drain(c);
+        }
+
+        luaogg_cut_accept(c,&page);
+
+        if(ogg_page_eos(&page) || (c->end >= 0 && granulepos >= c->end)) {
+            break;
+        }
+    }
+
+    luaogg_cut_finish(c);
+    luaogg_cut_flush(c);
+
+    lua_pushinteger(L,c->pages);
+    lua_pushinteger(L,c->bytes);
+    return 2;
+}
+
+static const struct luaL_Reg luaogg_int64_metamethods[] = {
+    { "__add",      luaogg_int64__add      },
+    { "__sub",      luaogg_int64__sub      },
+    { "__mul",      luaogg_int64__mul      },
+    { "__div",      luaogg_int64__div      },
+    { "__idiv",     luaogg_int64__div      },
     { "__mod",      luaogg_int64__mod      },
     { "__pow",      luaogg_int64__pow      },
     { "__unm",      luaogg_int64__unm      },
@@ -825,14 +3463,53 @@ static const struct luaL_Reg luaogg_int64_metamethods[] = {
     { NULL,         NULL                   },
 };
 
+static const struct luaL_Reg luaogg_header_cache_methods[] = {
+    { "pages",      luaogg_header_cache_pages      },
+    { "complete",   luaogg_header_cache_complete   },
+    { "count",      luaogg_header_cache_count      },
+    { "generation", luaogg_header_cache_generation },
+    { "clear",      luaogg_header_cache_clear      },
+    { NULL,         NULL                           },
+};
+
+static const struct luaL_Reg luaogg_codec_info_methods[] = {
+    { "packet_samples",  luaogg_codec_info_packet_samples  },
+    { "packets_samples", luaogg_codec_info_packets_samples },
+    { "reset",           luaogg_codec_info_reset           },
+    { NULL,              NULL                              },
+};
+
+static const struct luaL_Reg luaogg_skeleton_methods[] = {
+    { "packetin",    luaogg_skeleton_packetin    },
+    { "seek_offset", luaogg_skeleton_seek_offset },
+    { "keypoints",   luaogg_skeleton_keypoints   },
+    { "info",        luaogg_skeleton_info        },
+    { NULL,          NULL                        },
+};
+
+static const struct luaL_Reg luaogg_stream_pool_methods[] = {
+    { "acquire", luaogg_stream_pool_acquire },
+    { "release", luaogg_stream_pool_release },
+    { "stats",   luaogg_stream_pool_stats   },
+    { "clear",   luaogg_stream_pool_clear   },
+    { NULL,      NULL                       },
+};
+
 static const luaogg_metamethods luaogg_sync_state_metamethods[] = {
     { "ogg_sync_init", "init"         },
     { "ogg_sync_check", "check"       },
     { "ogg_sync_clear", "clear"       },
     { "ogg_sync_reset", "reset"       },
     { "ogg_sync_buffer", "buffer"     },
+    { "ogg_sync_buffer_many", "buffer_many" },
     { "ogg_sync_pageseek", "pageseek" },
     { "ogg_sync_pageout", "pageout"   },
+    { "ogg_sync_set_header_cache", "set_header_cache" },
+    { "ogg_sync_set_serialno_filter", "set_serialno_filter" },
+    { "ogg_sync_stats", "stats" },
+    { "ogg_sync_set_trusted", "set_trusted" },
+    { "ogg_sync_clone", "clone" },
+    { "ogg_sync_serialize", "serialize" },
     { NULL, NULL },
 };
 
@@ -850,6 +3527,11 @@ static const luaogg_metamethods luaogg_stream_state_metamethods[] = {
     { "ogg_stream_clear",           "clear"          },
     { "ogg_stream_reset",           "reset"          },
     { "ogg_stream_reset_serialno",  "reset_serialno" },
+    { "ogg_stream_set_header_cache", "set_header_cache" },
+    { "ogg_stream_set_granule_codec", "set_granule_codec" },
+    { "ogg_stream_set_flush_policy", "set_flush_policy" },
+    { "ogg_stream_clone",           "clone"          },
+    { "ogg_stream_serialize",       "serialize"      },
     { NULL, NULL },
 };
 
@@ -860,8 +3542,15 @@ static const struct luaL_Reg luaogg_functions[] = {
     { "ogg_sync_clear",            luaogg_ogg_sync_clear },
     { "ogg_sync_reset",            luaogg_ogg_sync_reset },
     { "ogg_sync_buffer",           luaogg_ogg_sync_buffer },
+    { "ogg_sync_buffer_many",      luaogg_ogg_sync_buffer_many },
     { "ogg_sync_pageseek",         luaogg_ogg_sync_pageseek },
     { "ogg_sync_pageout",          luaogg_ogg_sync_pageout },
+    { "ogg_sync_set_header_cache", luaogg_ogg_sync_set_header_cache },
+    { "ogg_sync_set_serialno_filter", luaogg_ogg_sync_set_serialno_filter },
+    { "ogg_sync_stats",            luaogg_ogg_sync_stats },
+    { "ogg_sync_set_trusted",      luaogg_ogg_sync_set_trusted },
+    { "ogg_sync_clone",            luaogg_ogg_sync_clone },
+    { "ogg_sync_serialize",        luaogg_ogg_sync_serialize },
     { "ogg_stream_state",          luaogg_ogg_stream_state },
     { "ogg_stream_pagein",         luaogg_ogg_stream_pagein  },
     { "ogg_stream_packetout",      luaogg_ogg_stream_packetout  },
@@ -876,7 +3565,21 @@ static const struct luaL_Reg luaogg_functions[] = {
     { "ogg_stream_clear",          luaogg_ogg_stream_clear  },
     { "ogg_stream_reset",          luaogg_ogg_stream_reset  },
     { "ogg_stream_reset_serialno", luaogg_ogg_stream_reset_serialno  },
+    { "ogg_stream_set_header_cache", luaogg_ogg_stream_set_header_cache },
+    { "ogg_stream_set_granule_codec", luaogg_ogg_stream_set_granule_codec },
+    { "ogg_stream_set_flush_policy", luaogg_ogg_stream_set_flush_policy },
+    { "ogg_stream_clone",          luaogg_ogg_stream_clone },
+    { "ogg_stream_serialize",      luaogg_ogg_stream_serialize },
     { "ogg_int64_t",               luaogg_int64 },
+    { "cut",                       luaogg_cut },
+    { "header_cache",              luaogg_header_cache_new },
+    { "opus_info",                 luaogg_opus_info },
+    { "vorbis_info",               luaogg_vorbis_info },
+    { "opus_packet_samples",       luaogg_opus_packet_samples_lua },
+    { "page_headers",              luaogg_page_headers },
+    { "deserialize",               luaogg_deserialize },
+    { "skeleton",                  luaogg_skeleton_new },
+    { "stream_pool",               luaogg_stream_pool_new },
     { NULL,                        NULL },
 };
 
@@ -903,7 +3606,7 @@ int luaopen_luaogg(lua_State *L) {
     luaL_setfuncs(L,luaogg_functions,0);
 
     luaL_newmetatable(L,luaogg_sync_state_mt);
-    lua_getfield(L,-2,"ogg_sync_clear");
+    lua_pushcfunction(L,luaogg_ogg_sync_state__gc);
     lua_setfield(L,-2,"__gc");
 
     lua_newtable(L); /* __index */
@@ -916,7 +3619,7 @@ int luaopen_luaogg(lua_State *L) {
     lua_pop(L,1);
 
     luaL_newmetatable(L,luaogg_stream_state_mt);
-    lua_getfield(L,-2,"ogg_stream_clear");
+    lua_pushcfunction(L,luaogg_ogg_stream_state__gc);
     lua_setfield(L,-2,"__gc");
 
     lua_newtable(L);
@@ -929,6 +3632,41 @@ int luaopen_luaogg(lua_State *L) {
     lua_setfield(L,-2,"__index");
     lua_pop(L,1);
 
+    luaL_newmetatable(L,luaogg_header_cache_mt);
+    lua_pushcfunction(L,luaogg_header_cache__gc);
+    lua_setfield(L,-2,"__gc");
+
+    lua_newtable(L);
+    luaL_setfuncs(L,luaogg_header_cache_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,luaogg_codec_info_mt);
+    lua_newtable(L);
+    luaL_setfuncs(L,luaogg_codec_info_methods,0);
+    lua_setfield(L,-2,"methods");
+    lua_pushcfunction(L,luaogg_codec_info__index);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,luaogg_skeleton_mt);
+    lua_pushcfunction(L,luaogg_skeleton__gc);
+    lua_setfield(L,-2,"__gc");
+
+    lua_newtable(L);
+    luaL_setfuncs(L,luaogg_skeleton_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,luaogg_stream_pool_mt);
+    lua_pushcfunction(L,luaogg_stream_pool__gc);
+    lua_setfield(L,-2,"__gc");
+
+    lua_newtable(L);
+    luaL_setfuncs(L,luaogg_stream_pool_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
     return 1;
 }
 